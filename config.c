@@ -1,11 +1,8 @@
-#include <strings.h>
-#include <string.h>
-
 #include "ctrlmenu.h"
 
 struct Config config = {
-	.fstrncmp               = strncmp,
-	.fstrstr                = strstr,
+	.casefold               = 0,
+	.fuzzy                  = 0,
 
 	.faceName               = "monospace:size=9",
 
@@ -32,6 +29,7 @@ struct Config config = {
 	.shadowThickness        = 2,
 	.gap                    = 0,
 	.alignment              = ALIGN_LEFT,
+	.timeout                = 10,
 
 	.max_items              = 0,
 	.tornoff                = 0,
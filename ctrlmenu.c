@@ -1,6 +1,6 @@
-#include <sys/wait.h>
-
 #include <err.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,12 +10,22 @@
 #include "ctrlmenu.h"
 
 #define TORNOFF_HEIGHT     (config.tornoff ? SEPARATOR_HEIGHT : 0)
-#define ALARMFLAGS         (XSyncCACounter | XSyncCAValue | XSyncCAValueType | XSyncCATestType | XSyncCADelta)
 #define MODS               (ShiftMask | ControlMask | Mod1Mask | Mod4Mask)
 #define SCROLL_TIME        100
 #define SCROLL_WAIT        200
 #define ICONPATH           "ICONPATH"   /* environment variable name */
 #define RUNNER             "RUNNER"
+#define LOADING            "..."        /* row shown while a submenu is generated */
+#define POOLSIZE           8            /* unmapped popup windows kept for reuse */
+
+/* popup windows kept unmapped, with their pixmaps, to be reused by popup menus */
+static struct PopupWindow {
+	Window win;
+	Pixmap pix;                     /* None if not created yet */
+	XftDraw *draw;
+	int pixw, pixh;
+} pool[POOLSIZE];
+static int npool = 0;
 
 /* predicate on item (and another argument) */
 typedef int (*ItemPred)(struct Item *, void *);
@@ -24,11 +34,10 @@ struct Control {
 	int running;                    /* are we running? */
 
 	/*
-	 * We use the XSync extension for scrolling.
+	 * While the pointer rests on a scroll button, a timer scrolls
+	 * the menu one entry at a time.
 	 */
 	Window scrollwin;               /* the window being scrolled */
-	XSyncAlarm alarm;
-	XSyncAlarmAttributes attr;
 
 	/*
 	 * The list of items specified in the config file is listed on
@@ -90,10 +99,22 @@ static struct Item scrolldown = { .name = "scrolldown" };
 static void
 usage(void)
 {
-	(void)fprintf(stderr, "usage: ctrlmenu [-dit] [-a keysym] [-r keychord] [-x buttonspec] [file]\n");
+	(void)fprintf(stderr, "usage: ctrlmenu [-dfit] [-a keysym] [-r keychord] [-x buttonspec] [file]\n");
 	exit(1);
 }
 
+/* get the icon of item; return whether it has just become ready to be drawn */
+static int
+loadicon(struct Item *item)
+{
+	if (item->file == NULL || (item->flags & ITEM_ICON))
+		return 0;
+	if (geticon(item->file, &item->icon) == -1)
+		return 0;
+	item->flags |= ITEM_ICON;
+	return item->icon != 0;
+}
+
 static void
 drawmenu(struct Menu *menu, struct Item *oldsel, int menutype, int alt, int drawall)
 {
@@ -102,7 +123,6 @@ drawmenu(struct Menu *menu, struct Item *oldsel, int menutype, int alt, int draw
 	XftColor *colorfg, *colorbg, *coloracc;
 	size_t acclen;
 	int beg, textx, texty, separatorx, separatorwid, right, icony, x;
-	int altx, altw;
 	int issel;
 
 	/* draw menu */
@@ -129,7 +149,9 @@ drawmenu(struct Menu *menu, struct Item *oldsel, int menutype, int alt, int draw
 		rect.y += SEPARATOR_HEIGHT;
 	for (item = menu->first; item != NULL; item = TAILQ_NEXT(item, entries)) {
 		rect.height = item->name != NULL ? config.itemheight : SEPARATOR_HEIGHT;
-		if (!drawall && item != oldsel && item != menu->selected)
+
+		/* icons are decoded in the background; rows are drawn again as they arrive */
+		if (!loadicon(item) && !drawall && item != oldsel && item != menu->selected)
 			goto donewithitem;
 		issel = item == menu->selected;
 		coloracc = (issel ? &dc.colors[COLOR_MENU].altselforeground : &dc.colors[COLOR_MENU].altforeground);
@@ -144,39 +166,32 @@ drawmenu(struct Menu *menu, struct Item *oldsel, int menutype, int alt, int draw
 			drawrectangle(menu->pix, rect, colorbg->pixel);
 
 			/* draw item icon */
-			if (item->file != NULL) {
-				if (!(item->flags & ITEM_ICON)) {
-					geticon(menu->win, item->file, &item->icon, &item->mask);
-					item->flags |= ITEM_ICON;
-				}
-				if (item->icon != None) {
-					drawicon(menu->pix, item->icon, item->mask, PADDING, rect.y + icony);
-				}
+			if (item->icon != 0) {
+				drawicon(menu->draw, item->icon, PADDING, rect.y + icony);
 			}
 
 			/* draw item text */
+			measureitem(item);
 			x = textx;
 			if (config.alignment == ALIGN_CENTER)
-				x += (menu->maxwidth - textwidth(item->name, item->len)) / 2;
+				x += (menu->maxwidth - item->namew) / 2;
 			else if (config.alignment == ALIGN_RIGHT)
-				x += menu->maxwidth - textwidth(item->name, item->len);
+				x += menu->maxwidth - item->namew;
 			x = max(textx, x);
-			if (alt && item->altlen > 0 && item->altpos + item->altlen <= item->len) {
-				altx = x + textwidth(item->name, item->altpos);
-				altw = textwidth(item->name + item->altpos, item->altlen);
+			if (alt && item->altw > 0) {
 				drawrectangle(
 					menu->pix,
-					(XRectangle){ .x = altx, .y = texty + 1, .width = altw, .height = 1 },
+					(XRectangle){ .x = x + item->altx, .y = texty + 1, .width = item->altw, .height = 1 },
 					colorfg->pixel
 				);
 			}
-			drawtext(menu->pix, colorfg, x, texty, item->name, item->len);
+			drawtext(menu->draw, colorfg, x, texty, item->name, item->len);
 			if (item->acc != NULL) {
 				acclen = strlen(item->acc);
 				drawtext(
-					menu->pix,
+					menu->draw,
 					coloracc,
-					menu->rect.width - textwidth(item->acc, acclen) - right,
+					menu->rect.width - item->accw - right,
 					texty,
 					item->acc,
 					acclen
@@ -198,6 +213,17 @@ donewithitem:
 			break;
 		}
 	}
+	if (drawall && item == NULL && menu->gen != NULL) {
+		/* the script of the menu is still running */
+		drawtext(
+			menu->draw,
+			&dc.colors[COLOR_MENU].altforeground,
+			textx,
+			rect.y + (config.itemheight + dc.fontascent) / 2,
+			LOADING,
+			strlen(LOADING)
+		);
+	}
 
 	rect.x = rect.y = 0;
 	rect.width = menu->rect.width;
@@ -255,7 +281,7 @@ donewithitem:
 			dc.bottomShadow.pixel
 		);
 	}
-	commitdrawing(menu->win, menu->pix, menu->rect);
+	presentdrawing(menu->win, menu->pix);
 	XFlush(dpy);
 }
 
@@ -275,6 +301,10 @@ setdockedmenu(struct Menu *root, struct ItemQueue *itemq)
 		.isgen = 0,
 		.selected = NULL,
 		.pix = None,
+		.draw = NULL,
+		.pixw = 0,
+		.pixh = 0,
+		.reusable = 0,
 		.rect = (XRectangle){
 			.x = 0,
 			.y = 0,
@@ -284,7 +314,8 @@ setdockedmenu(struct Menu *root, struct ItemQueue *itemq)
 	};
 	TAILQ_FOREACH(item, root->queue, entries) {
 		if (item->name != NULL) {
-			textw = textwidth(item->name, strlen(item->name));
+			measureitem(item);
+			textw = item->namew;
 			root->rect.height += config.itemheight;
 		} else {
 			textw = 0;
@@ -296,51 +327,46 @@ setdockedmenu(struct Menu *root, struct ItemQueue *itemq)
 	root->rect.width += PADDING * 2;
 	root->win = createwindow(&root->rect, MENU_DOCKAPP, CLASS);
 	root->pix = createpixmap(root->rect, root->win);
+	root->draw = createdraw(root->pix);
+	root->pixw = root->rect.width;
+	root->pixh = root->rect.height;
 	drawmenu(root, NULL, MENU_DOCKAPP, 0, 1);
 	mapwin(root->win);
 }
 
 static void
-insertmenu(struct MenuQueue *menuq, Window parentwin, XRectangle parentrect, struct ItemQueue *itemq, struct Item *caller, int type, int y)
+growmenu(struct Menu *menu, int menuh)
+{
+	if (menu->overflow)
+		return;
+	if (menuh + config.itemheight + SEPARATOR_HEIGHT * 2 < menu->mon.height) {
+		menu->rect.height = menuh;
+	} else {
+		menu->overflow = 1;
+		menu->rect.height = menu->mon.height;
+	}
+}
+
+/* compute the size of the menu from its items */
+static void
+sizemenu(struct Menu *menu, int type)
 {
-	XRectangle mon;
-	struct Menu *menu;
 	struct Item *item;
-	int menuh, textw, accelw, xplusw, gap;
+	int menuh, textw, accelw;
 	int nitems;
 
-	getmonitors();
-	translatecoordinates(parentwin, &parentrect.x, &parentrect.y);
-	mon = getselmon(&parentrect);
-	menu = emalloc(sizeof(*menu));
-	gap = (caller != NULL ? config.gap : 0);
-	*menu = (struct Menu){
-		.queue = itemq,
-		.first = TAILQ_FIRST(itemq),
-		.caller = caller,
-		.overflow = 0,
-		.maxwidth = 0,
-		.isgen = (caller != NULL && caller->genscript != NULL),
-		.hasicon = 0,
-		.selected = NULL,
-		.pix = None,
-		.rect = (XRectangle){
-			.x = parentrect.x,
-			.y = parentrect.y,
-			.width = config.shadowThickness * 2 + SEPARATOR_HEIGHT,
-			.height = config.shadowThickness * 2 + SEPARATOR_HEIGHT,
-		},
-	};
+	menu->overflow = 0;
+	menu->maxwidth = 0;
+	menu->hasicon = 0;
+	menu->rect.width = config.shadowThickness * 2 + SEPARATOR_HEIGHT;
+	menu->rect.height = config.shadowThickness * 2 + SEPARATOR_HEIGHT;
 	if (type == MENU_TORNOFF) {
 		/* remove shadow from tornoff menus */
-		menu->rect.x += config.shadowThickness;
-		menu->rect.y += config.shadowThickness;
 		menu->rect.width = max(0, menu->rect.width - 2 * config.shadowThickness);
 		menu->rect.height = max(0, menu->rect.height - 2 * config.shadowThickness);
 	}
-	TAILQ_INSERT_HEAD(menuq, menu, entries);
-	if (TAILQ_EMPTY(menu->queue))
-		goto done;
+	if (TAILQ_EMPTY(menu->queue) && menu->gen == NULL)
+		return;
 	menuh = 0;
 	if (type == MENU_POPUP)
 		menuh = config.shadowThickness * 2 + TORNOFF_HEIGHT;
@@ -348,9 +374,10 @@ insertmenu(struct MenuQueue *menuq, Window parentwin, XRectangle parentrect, str
 	nitems = 0;
 	TAILQ_FOREACH(item, menu->queue, entries) {
 		if (item->name != NULL) {
-			textw = textwidth(item->name, strlen(item->name));
+			measureitem(item);
+			textw = item->namew;
 			if (item->acc != NULL)
-				accelw = max(accelw, textwidth(item->acc, strlen(item->acc)) + 2 * PADDING);
+				accelw = max(accelw, item->accw + 2 * PADDING);
 			menuh += config.itemheight;
 			if (item->file != NULL)
 				menu->hasicon = 1;
@@ -362,14 +389,13 @@ insertmenu(struct MenuQueue *menuq, Window parentwin, XRectangle parentrect, str
 		menu->maxwidth = max(menu->maxwidth, textw);
 		if (config.max_items > 0 && nitems > config.max_items)
 			menu->overflow = 1;
-		if (!menu->overflow) {
-			if (menuh + config.itemheight + SEPARATOR_HEIGHT * 2 < mon.height) {
-				menu->rect.height = menuh;
-			} else {
-				menu->overflow = 1;
-				menu->rect.height = mon.height;
-			}
-		}
+		growmenu(menu, menuh);
+	}
+	if (menu->gen != NULL) {
+		/* room for the loading row */
+		menu->maxwidth = max(menu->maxwidth, textwidth(LOADING, strlen(LOADING)));
+		menuh += config.itemheight;
+		growmenu(menu, menuh);
 	}
 	menu->rect.width = menu->maxwidth + accelw;
 	menu->rect.width += dc.triangle_width + PADDING * 3;     /* PAD + name + PAD + triangle + PAD */
@@ -377,47 +403,159 @@ insertmenu(struct MenuQueue *menuq, Window parentwin, XRectangle parentrect, str
 		menu->rect.width += config.iconsize + PADDING;
 	if (type == MENU_POPUP)
 		menu->rect.width += config.shadowThickness * 2;
+}
 
-done:
-	if (type != MENU_TORNOFF) {
-		/*
-		 * Resize menu to fit the monitor.  We may also move it
-		 * according to the parent menu.  The argument y will be
-		 * the y position of the menu relative to its parent.
-		 */
-		menu->rect.x = mon.x;
-		menu->rect.y = mon.y;
-		xplusw = parentrect.x + parentrect.width + gap;
-		if (menu->rect.width > mon.width / 2)
-			menu->rect.width = mon.width / 2;
-		if (mon.x + mon.width - xplusw >= menu->rect.width) {
-			menu->rect.x = xplusw;
-		} else if (parentrect.x > menu->rect.width + gap) {
-			menu->rect.x = parentrect.x - menu->rect.width - gap;
-		}
-		y -= config.shadowThickness + TORNOFF_HEIGHT;
-		y = max(0, y);
-		if (mon.y + mon.height - (parentrect.y + y) >= menu->rect.height) {
-			menu->rect.y = parentrect.y + y;
-		} else if (mon.y + mon.height > menu->rect.height) {
-			menu->rect.y = mon.y + mon.height - menu->rect.height;
-		}
+/*
+ * Resize menu to fit the monitor.  We may also move it according to
+ * the parent menu.  The menu->y will be the y position of the menu
+ * relative to its parent.
+ */
+static void
+placemenu(struct Menu *menu)
+{
+	int xplusw, gap, y;
+
+	gap = (menu->caller != NULL ? config.gap : 0);
+	menu->rect.x = menu->mon.x;
+	menu->rect.y = menu->mon.y;
+	xplusw = menu->parentrect.x + menu->parentrect.width + gap;
+	if (menu->rect.width > menu->mon.width / 2)
+		menu->rect.width = menu->mon.width / 2;
+	if (menu->mon.x + menu->mon.width - xplusw >= menu->rect.width) {
+		menu->rect.x = xplusw;
+	} else if (menu->parentrect.x > menu->rect.width + gap) {
+		menu->rect.x = menu->parentrect.x - menu->rect.width - gap;
+	}
+	y = menu->y - config.shadowThickness - TORNOFF_HEIGHT;
+	y = max(0, y);
+	if (menu->mon.y + menu->mon.height - (menu->parentrect.y + y) >= menu->rect.height) {
+		menu->rect.y = menu->parentrect.y + y;
+	} else if (menu->mon.y + menu->mon.height > menu->rect.height) {
+		menu->rect.y = menu->mon.y + menu->mon.height - menu->rect.height;
 	}
+}
 
-	menu->win = createwindow(&menu->rect, type, caller != NULL ? caller->name : CLASS);
+static void
+configuremenu(struct Menu *menu, int x, int y, int w, int h)
+{
+	menu->rect.x = x;
+	menu->rect.y = y;
+	menu->rect.width = w;
+	menu->rect.height = h;
+	if (menu->pix != None && w <= menu->pixw && h <= menu->pixh)
+		return;         /* the pixmap is still large enough */
+	if (menu->pix != None)
+		freepixmap(menu->pix);
 	menu->pix = createpixmap(menu->rect, menu->win);
-	drawmenu(menu, NULL, type, 0, 1);
-	mapwin(menu->win);
+	menu->pixw = w;
+	menu->pixh = h;
+	if (menu->draw != NULL)
+		changedraw(menu->draw, menu->pix);
+	else
+		menu->draw = createdraw(menu->pix);
 }
 
+/* create the window and pixmap of a menu, or take pooled ones for a popup menu */
 static void
-insertpopupmenu(struct MenuQueue *menuq, Window parentwin, XRectangle parentrect, struct Item *caller, struct ItemQueue *itemq, int y)
+openwindow(struct Menu *menu, int type, const char *title)
 {
-	if (caller != NULL && caller->genscript != NULL) {
-		itemq = emalloc(sizeof(*itemq));
-		genmenu(itemq, caller);
+	struct PopupWindow *pw;
+
+	if (type == MENU_POPUP && npool > 0) {
+		pw = &pool[--npool];
+		menu->win = pw->win;
+		menu->pix = pw->pix;
+		menu->draw = pw->draw;
+		menu->pixw = pw->pixw;
+		menu->pixh = pw->pixh;
+		settitle(menu->win, title);
+		XMoveResizeWindow(dpy, menu->win, menu->rect.x, menu->rect.y, menu->rect.width, menu->rect.height);
+	} else {
+		menu->win = createwindow(&menu->rect, type, title);
 	}
-	insertmenu(menuq, parentwin, parentrect, itemq, caller, MENU_POPUP, y);
+	menu->reusable = (type == MENU_POPUP);
+	configuremenu(menu, menu->rect.x, menu->rect.y, menu->rect.width, menu->rect.height);
+}
+
+/* unmap the window of a menu into the pool, or destroy it with its pixmap */
+static void
+closewindow(struct Menu *menu)
+{
+	if (menu->reusable && npool < POOLSIZE) {
+		XUnmapWindow(dpy, menu->win);
+		pool[npool++] = (struct PopupWindow){
+			.win = menu->win,
+			.pix = menu->pix,
+			.draw = menu->draw,
+			.pixw = menu->pixw,
+			.pixh = menu->pixh,
+		};
+		return;
+	}
+	if (menu->draw != NULL)
+		freedraw(menu->draw);
+	if (menu->pix != None)
+		freepixmap(menu->pix);
+	XDestroyWindow(dpy, menu->win);
+}
+
+/* create the popup windows of the pool beforehand */
+static void
+initpool(void)
+{
+	XRectangle rect;
+
+	rect = (XRectangle){ .x = 0, .y = 0, .width = 1, .height = 1 };
+	while (npool < POOLSIZE) {
+		pool[npool++] = (struct PopupWindow){
+			.win = createwindow(&rect, MENU_POPUP, CLASS),
+			.pix = None,
+			.draw = NULL,
+			.pixw = 0,
+			.pixh = 0,
+		};
+	}
+}
+
+static struct Menu *
+insertmenu(struct MenuQueue *menuq, Window parentwin, XRectangle parentrect, struct ItemQueue *itemq, struct Item *caller, struct Generator *gen, int type, int y)
+{
+	struct Menu *menu;
+
+	getmonitors();
+	translatecoordinates(parentwin, &parentrect.x, &parentrect.y);
+	menu = emalloc(sizeof(*menu));
+	*menu = (struct Menu){
+		.queue = itemq,
+		.first = TAILQ_FIRST(itemq),
+		.caller = caller,
+		.parentrect = parentrect,
+		.mon = getselmon(&parentrect),
+		.gen = gen,
+		.y = y,
+		.overflow = 0,
+		.maxwidth = 0,
+		.isgen = (caller != NULL && caller->genscript != NULL),
+		.hasicon = 0,
+		.selected = NULL,
+		.pix = None,
+		.draw = NULL,
+		.pixw = 0,
+		.pixh = 0,
+		.reusable = 0,
+	};
+	TAILQ_INSERT_HEAD(menuq, menu, entries);
+	sizemenu(menu, type);
+	if (type == MENU_TORNOFF) {
+		menu->rect.x = parentrect.x + config.shadowThickness;
+		menu->rect.y = parentrect.y + config.shadowThickness;
+	} else {
+		placemenu(menu);
+	}
+	openwindow(menu, type, caller != NULL ? caller->name : CLASS);
+	drawmenu(menu, NULL, type, 0, 1);
+	mapwin(menu->win);
+	return menu;
 }
 
 static int
@@ -430,6 +568,23 @@ getmenutype(struct Control *ctrl, struct Menu *menu)
 	return MENU_POPUP;
 }
 
+/* draw the rows of the open menus whose icons have been decoded */
+static void
+iconsready(void *p)
+{
+	struct Control *ctrl;
+	struct Menu *menu;
+
+	ctrl = p;
+	if (config.mode & MODE_DOCKAPP)
+		drawmenu(&ctrl->docked, NULL, MENU_DOCKAPP, ctrl->menustate == STATE_ALT, 0);
+	TAILQ_FOREACH(menu, &ctrl->popupq, entries)
+		drawmenu(menu, NULL, getmenutype(ctrl, menu), 0, 0);
+	TAILQ_FOREACH(menu, &ctrl->tornoffq, entries) {
+		drawmenu(menu, NULL, getmenutype(ctrl, menu), 0, 0);
+	}
+}
+
 static struct Menu *
 getmenu(struct MenuQueue *menuq, Window win)
 {
@@ -499,14 +654,14 @@ getitem(struct Menu *menu, int menutype, int y, int *ytop)
 static void
 delmenu(struct Menu *menu, int delgen)
 {
+	if (delgen && menu->gen != NULL) {
+		stopgenerator(menu->gen);
+	}
 	if (delgen && menu->isgen) {
 		cleanitems(menu->queue);
 		free(menu->queue);
 	}
-	if (menu->pix != None) {
-		XFreePixmap(dpy, menu->pix);
-	}
-	XDestroyWindow(dpy, menu->win);
+	closewindow(menu);
 	free(menu);
 }
 
@@ -592,16 +747,75 @@ scroll(struct Control *ctrl, Window win)
 	return 1;
 }
 
+/* scroll the menu under the pointer again and again, until it cannot scroll further */
 static void
-configuremenu(struct Menu *menu, int x, int y, int w, int h)
+scrolltimer(void *p)
 {
-	menu->rect.x = x;
-	menu->rect.y = y;
-	menu->rect.width = w;
-	menu->rect.height = h;
-	if (menu->pix != None)
-		freepixmap(menu->pix);
-	menu->pix = createpixmap(menu->rect, menu->win);
+	struct Control *ctrl;
+
+	ctrl = p;
+	if (scroll(ctrl, ctrl->scrollwin))
+		settimer(SCROLL_TIME, scrolltimer, ctrl);
+	else
+		ctrl->scrollwin = None;
+}
+
+static struct Menu *
+getgenmenu(struct Control *ctrl, struct Generator *gen, int *type)
+{
+	struct Menu *menu;
+
+	*type = MENU_POPUP;
+	TAILQ_FOREACH(menu, &ctrl->popupq, entries)
+		if (menu->gen == gen)
+			return menu;
+	*type = MENU_TORNOFF;
+	TAILQ_FOREACH(menu, &ctrl->tornoffq, entries)
+		if (menu->gen == gen)
+			return menu;
+	return NULL;
+}
+
+/* grow the menu of a pipe meta-entry as its script outputs items */
+static void
+popupgenerated(struct Generator *gen, struct Item *first, int done, void *p)
+{
+	struct Control *ctrl;
+	struct Menu *menu;
+	int type;
+
+	ctrl = (struct Control *)p;
+	if ((menu = getgenmenu(ctrl, gen, &type)) == NULL)
+		return;
+	if (done)
+		menu->gen = NULL;
+	else if (first == NULL)
+		return;
+	if (menu->first == NULL)
+		menu->first = TAILQ_FIRST(menu->queue);
+	sizemenu(menu, type);
+	if (type == MENU_POPUP)
+		placemenu(menu);
+	configuremenu(menu, menu->rect.x, menu->rect.y, menu->rect.width, menu->rect.height);
+	XMoveResizeWindow(dpy, menu->win, menu->rect.x, menu->rect.y, menu->rect.width, menu->rect.height);
+	drawmenu(menu, NULL, type, 0, 1);
+}
+
+/*
+ * Open the submenu of an item.  The submenu of a pipe meta-entry is
+ * mapped at once, and filled as its script outputs items.
+ */
+static void
+insertpopupmenu(struct Control *ctrl, Window parentwin, XRectangle parentrect, struct Item *caller, struct ItemQueue *itemq, int y)
+{
+	struct Generator *gen;
+
+	gen = NULL;
+	if (caller != NULL && caller->genscript != NULL) {
+		itemq = emalloc(sizeof(*itemq));
+		gen = startgenerator(itemq, caller, popupgenerated, ctrl);
+	}
+	(void)insertmenu(&ctrl->popupq, parentwin, parentrect, itemq, caller, gen, MENU_POPUP, y);
 }
 
 static unsigned int
@@ -703,7 +917,7 @@ initpopped(struct Control *ctrl, struct Menu *rootmenu, Window parentwin, XRecta
 {
 	if (grab(GRAB_POINTER | GRAB_KEYBOARD) == -1)
 		removepopped(ctrl);
-	insertpopupmenu(&ctrl->popupq, parentwin, parentrect, caller, itemq, y);
+	insertpopupmenu(ctrl, parentwin, parentrect, caller, itemq, y);
 	ctrl->curroot = rootmenu;
 	ctrl->menustate = STATE_POPUP;
 	return;
@@ -877,7 +1091,7 @@ openitem(struct Control *ctrl, struct Menu *menu, struct Item *item, int delete,
 				return;
 			initpopped(ctrl, menu, menu->win, menu->rect, item, &item->children, y);
 		} else {
-			insertpopupmenu(&ctrl->popupq, menu->win, menu->rect, item, &item->children, y);
+			insertpopupmenu(ctrl, menu->win, menu->rect, item, &item->children, y);
 		}
 	} else if (!ismotion && item->genscript == NULL && TAILQ_EMPTY(&item->children)) {
 		enteritem(item);
@@ -1005,14 +1219,14 @@ xevmotion(XEvent *e, struct Control *ctrl)
 	}
 	if (item == &scrollup || item == &scrolldown) {
 		/* motion over scroll buttons */
+		if (ctrl->scrollwin != xev->window)
+			settimer(SCROLL_WAIT, scrolltimer, ctrl);
 		ctrl->scrollwin = xev->window;
-		if (ctrl->alarm == None)
-			ctrl->alarm = XSyncCreateAlarm(dpy, ALARMFLAGS, &ctrl->attr);
 		return;
 	}
-	if (ctrl->alarm != None) {
-		XSyncDestroyAlarm(dpy, ctrl->alarm);
-		ctrl->alarm = None;
+	if (ctrl->scrollwin != None) {
+		deltimer(scrolltimer, ctrl);
+		ctrl->scrollwin = None;
 	}
 	if (item == NULL)
 		return;
@@ -1047,7 +1261,9 @@ xevbrelease(XEvent *e, struct Control *ctrl)
 		return;
 	if (item == &tornoff && ctrl->menustate == STATE_POPUP) {
 		TAILQ_REMOVE(&ctrl->popupq, menu, entries);
-		insertmenu(&ctrl->tornoffq, menu->win, menu->rect, menu->queue, menu->caller, MENU_TORNOFF, 0);
+		/* the tornoff menu keeps being filled by the generator */
+		(void)insertmenu(&ctrl->tornoffq, menu->win, menu->rect, menu->queue, menu->caller, menu->gen, MENU_TORNOFF, 0);
+		menu->gen = NULL;
 		delmenu(menu, 0);
 		removepopped(ctrl);
 		return;
@@ -1186,6 +1402,12 @@ xevconfigure(XEvent *e, struct Control *ctrl)
 	xev = &e->xconfigure;
 	if ((menu = getopenmenu(ctrl, xev->window)) == NULL)
 		return;
+	if (xev->width == menu->rect.width && xev->height == menu->rect.height) {
+		/* just moved; the contents are still right */
+		menu->rect.x = xev->x;
+		menu->rect.y = xev->y;
+		return;
+	}
 	type = getmenutype(ctrl, menu);
 	alt = type == MENU_DOCKAPP && ctrl->menustate == STATE_ALT;
 	configuremenu(menu, xev->x, xev->y, xev->width, xev->height);
@@ -1214,16 +1436,6 @@ xevclient(XEvent *e, struct Control *ctrl)
 	delmenu(menu, 1);
 }
 
-static void
-xevalarm(XEvent *e, struct Control *ctrl)
-{
-	if (e->type != sync_event + XSyncAlarmNotify || ctrl->alarm == None)
-		return;
-	if (!scroll(ctrl, ctrl->scrollwin))
-		ctrl->scrollwin = None;
-	XSyncChangeAlarm(dpy, ctrl->alarm, ALARMFLAGS, &ctrl->attr);
-}
-
 static void
 xevmapping(XEvent *e, struct Control *ctrl)
 {
@@ -1253,13 +1465,6 @@ run(struct Control *ctrl)
 	XEvent ev;
 	int x, y;
 
-	ctrl->attr = (XSyncAlarmAttributes){
-		.trigger.counter        = servertime,
-		.trigger.value_type     = XSyncRelative,
-		.trigger.test_type      = XSyncPositiveComparison,
-	};
-	XSyncIntToValue(&ctrl->attr.trigger.wait_value, 128);
-	XSyncIntToValue(&ctrl->attr.delta, 0);
 	TAILQ_INIT(&ctrl->tornoffq);
 	TAILQ_INIT(&ctrl->popupq);
 	ctrl->curroot = NULL;
@@ -1271,9 +1476,9 @@ run(struct Control *ctrl)
 	if (config.mode & MODE_DOCKAPP)
 		setdockedmenu(&ctrl->docked, ctrl->itemq);
 	initgrabs(ctrl);
+	initpool();
 	ctrl->scrollwin = None;
 	ctrl->promptopen = 0;
-	ctrl->alarm = None;
 	if (config.mode == 0) {
 		querypointer(&x, &y);
 		rect = (XRectangle){ .x = x, .y = y, .width = 0, .height = 0 },
@@ -1282,13 +1487,11 @@ run(struct Control *ctrl)
 		ctrl->menustate = STATE_NORMAL;
 	}
 	ctrl->running = 1;
-	while (ctrl->running && !XNextEvent(dpy, &ev)) {
+	while (ctrl->running && !nextevent(&ev)) {
 		if (XFilterEvent(&ev, None))
 			;
 		else if (ev.type < LASTEvent && xevents[ev.type])
 			(*xevents[ev.type])(&ev, ctrl);
-		else
-			xevalarm(&ev, ctrl);
 		XAllowEvents(dpy, ReplayKeyboard, CurrentTime);
 		XAllowEvents(dpy, ctrl->passclick ? ReplayPointer : AsyncPointer, CurrentTime);
 	}
@@ -1316,29 +1519,25 @@ parseiconpaths(char *s)
 void
 enteritem(struct Item *item)
 {
+	char **argv;
 	char *cmd, *arg;
 
 	if (item == NULL)
 		return;
 	if (item->flags & ITEM_ISGEN) {
 		cmd = item->caller->cmd;
+		argv = item->caller->argv;
 		arg = (item->cmd != NULL) ? item->cmd : item->name;
 	} else {
 		cmd = (item->cmd != NULL) ? item->cmd : item->name;
+		argv = item->argv;
 		arg = NULL;
 	}
-	if (efork() == 0) {
-		esetsid();
-		if (efork() == 0) {
-			if (item->flags & ITEM_OPENER)
-				eexeccmd(opener, cmd);
-			else
-				eexecshell(cmd, arg);
-			exit(0);
-		}
-		exit(0);
-	}
-	wait(NULL);
+	logfrecency(item);
+	if (item->flags & ITEM_OPENER)
+		launchcmd(opener, cmd);
+	else if (argv == NULL || launch(argv) == -1)    /* not found; may be a shell builtin */
+		launchshell(cmd, arg);
 }
 
 int
@@ -1388,6 +1587,9 @@ main(int argc, char *argv[])
 	if ((s = getresource("gap", NULL, NULL)) != NULL &&
 	    (n = strtol(s, NULL, 10)) > 0 && n < 100)
 		config.gap = n;
+	if ((s = getresource("timeout", NULL, NULL)) != NULL &&
+	    (n = strtol(s, NULL, 10)) >= 0 && n <= INT_MAX / 1000)
+		config.timeout = n;
 	if ((s = getresource("maxItems", NULL, NULL)) != NULL &&
 	    (n = strtol(s, NULL, 10)) > 0 && n < 100)
 		config.max_items = n;
@@ -1401,7 +1603,8 @@ main(int argc, char *argv[])
 		}
 	}
 	config.tornoff = isresourcetrue(getresource("tornoff", NULL, NULL));
-	while ((c = getopt(argc, argv, "a:ditr:x:")) != -1) {
+	config.fuzzy = isresourcetrue(getresource("fuzzy", NULL, NULL));
+	while ((c = getopt(argc, argv, "a:dfitr:x:")) != -1) {
 		switch (c) {
 		case 'a':
 			config.altkey = optarg;
@@ -1409,9 +1612,11 @@ main(int argc, char *argv[])
 		case 'd':
 			config.mode |= MODE_DOCKAPP;
 			break;
+		case 'f':
+			config.fuzzy = 1;
+			break;
 		case 'i':
-			config.fstrncmp = strncasecmp;
-			config.fstrstr  = strcasestr;
+			config.casefold = 1;
 			break;
 		case 't':
 			config.tornoff = 1;
@@ -1446,6 +1651,11 @@ main(int argc, char *argv[])
 		usage();
 	}
 	initdc();
+	initcache();
+	initchildren();
+	/* writing to a calculator that has exited must fail, not kill us */
+	(void)signal(SIGPIPE, SIG_IGN);
+	initicons(iconsready, &ctrl);
 	ctrl.itemq = &itemq;
 	run(&ctrl);
 	free(config.iconpath);
@@ -1,5 +1,8 @@
 #include <sys/queue.h>
 
+#include <stdint.h>
+#include <time.h>
+
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
 #include <X11/Xutil.h>
@@ -8,7 +11,6 @@
 #include <X11/Xft/Xft.h>
 #include <X11/cursorfont.h>
 #include <X11/extensions/Xinerama.h>
-#include <X11/extensions/sync.h>
 
 #define CLASS "CtrlMenu"
 #define NAME  "ctrlmenu"
@@ -20,14 +22,16 @@
 #define LEN(x)                  (sizeof(x) / sizeof(*(x)))
 #define MAXPATHS                128          /* maximum number of paths to look for icons */
 #define ICONPATH                "ICONPATH"   /* environment variable name */
+#define SHELL                   "sh"
+#define CALCMARKER              "<ctrlmenu>" /* line ending each answer of the calculator */
 
 struct Control;
 struct Prompt;
+struct Generator;
 
 enum {
 	ITEM_ISGEN       = 0x1,
 	ITEM_ICON        = 0x2,
-	ITEM_FOUNDCALLER = 0x4,
 	ITEM_OPENER      = 0x8,
 };
 
@@ -96,6 +100,13 @@ enum {
 	ATOM_LAST
 };
 
+enum {
+	CHILD_LAUNCHED,                 /* command of an entry */
+	CHILD_GENERATOR,                /* script of a pipe meta-entry */
+	CHILD_CALCULATOR,               /* calculator of the runner */
+	CHILD_LAST
+};
+
 enum {
 	ALIGN_LEFT,
 	ALIGN_CENTER,
@@ -141,9 +152,14 @@ struct Item {
 	char *acc;                      /* accelerator */
 	char *file;                     /* path to icon file */
 	char *genscript;                /* commands piped to sh to generate entries */
+	char **argv;                    /* command split into words, or NULL if run by sh */
+	int ttl;                        /* seconds the output of genscript is cached for */
+	int timeout;                    /* seconds genscript may run for, or 0 for the default */
 	unsigned int altpos, altlen;    /* alternative key sequence */
-	Pixmap icon;
-	Pixmap mask;
+	unsigned long measured;         /* font the widths below were measured with, or 0 */
+	int namew, accw;                /* widths of the name and of the accelerator */
+	int altx, altw;                 /* offset and width of the alternative key sequence */
+	int icon;                       /* cell of the icon in the icon atlas, or 0 */
 	KeySym altkey;
 	size_t len;
 	int flags;
@@ -167,15 +183,22 @@ struct Menu {
 	XRectangle rect;                /* menu geometry */
 	Window win;                     /* menu window to map on the screen */
 	Pixmap pix;                     /* pixmap to draw on */
+	XftDraw *draw;                  /* to draw text on the pixmap */
+	int pixw, pixh;                 /* size of the pixmap, which may be larger than the menu */
+	int reusable;                   /* whether the window can be reused by another popup menu */
 	int overflow;                   /* whether the menu is higher than the monitor */
+	XRectangle parentrect;          /* parent menu geometry, to place the menu on */
+	XRectangle mon;                 /* monitor the menu is on */
+	struct Generator *gen;          /* generator still filling the menu, or NULL */
+	int y;                          /* menu position relative to its parent */
 	int maxwidth;                   /* maximum width of a text on the menu */
 	int isgen;                      /* whether menu was generated from a genscript */
 	int hasicon;                    /* whether menu has an entry with icon */
 };
 
 struct Config {
-	int (*fstrncmp)(const char *, const char *, size_t);
-	char *(*fstrstr)(const char *, const char *);
+	int casefold;
+	int fuzzy;
 	const char *faceName;
 	struct {
 		const char *background;
@@ -202,6 +225,7 @@ struct Config {
 	int iconsize;
 	int mode;
 	int gap;
+	int timeout;
 
 	char *iconpaths[MAXPATHS];
 	int niconpaths;
@@ -221,6 +245,7 @@ struct DC {
 	XftColor topShadow;
 	XftColor bottomShadow;
 	GC gc;
+	unsigned long fontid;           /* changes whenever face does */
 	int fontascent;
 	int triangle_width;
 	int triangle_height;
@@ -232,17 +257,29 @@ extern Display *dpy;
 extern XIM xim;
 extern Atom atoms[];
 extern Window root;
-extern int sync_event;
-extern XSyncCounter servertime;
-extern char *opener, *calculator;
+extern char *opener, *calculator, *calcsentinel;
 
 /* parse.c */
-void genmenu(struct ItemQueue *itemq, struct Item *caller);
-void runcalc(struct ItemQueue *itemq, char *text);
+struct Generator *startgenerator(struct ItemQueue *itemq, struct Item *caller, void (*fn)(struct Generator *, struct Item *, int, void *), void *arg);
+void stopgenerator(struct Generator *gen);
+void initcache(void);
+void evalcalc(const char *expr, void (*fn)(const char *, struct ItemQueue *, void *), void *arg);
+void cancelcalc(void);
 void readfile(FILE *fp, char *filename, struct ItemQueue *itemq, struct AcceleratorQueue *accq);
 void cleanitems(struct ItemQueue *itemq);
 void cleanaccelerators(struct AcceleratorQueue *accq);
 
+/* history.c */
+uint64_t itemkey(struct Item *item);
+void loadfrecency(void);
+void logfrecency(struct Item *item);
+void compactfrecency(void);
+int frecency(uint64_t key, time_t now);
+size_t loadhistory(void);
+char *gethistory(size_t n, char *buf, size_t size);
+size_t addhistory(const char *text);
+void compacthistory(void);
+
 /* util.c */
 int max(int x, int y);
 int min(int x, int y);
@@ -252,21 +289,32 @@ void *erealloc(void *ptr, size_t size);
 char *estrdup(const char *s);
 char *estrndup(const char *s, size_t maxlen);
 void epipe(int fd[]);
-void eexecshell(const char *cmd, const char *arg);
-void eexeccmd(const char *cmd, const char *arg);
-void edup2(int fd1, int fd2);
-pid_t efork(void);
-void esetsid(void);
+void setdeadline(struct timespec *deadline, int msec);
+int timeleft(const struct timespec *deadline);
+void initchildren(void);
+pid_t startchild(int role, char *const argv[], char *const envp[], const int fd[3]);
+void setchildfds(pid_t pid, int in, int out, int err);
+void killchild(pid_t pid);
+char **splitcmd(const char *cmd);
+int launch(char *const argv[]);
+void launchshell(const char *cmd, const char *arg);
+void launchcmd(const char *cmd, const char *arg);
+void addwatch(int fd, int timeout, void (*fn)(int, int, void *), void *arg);
+void delwatch(int fd);
+void settimer(int msec, void (*fn)(void *), void *arg);
+void deltimer(void (*fn)(void *), void *arg);
+int nextevent(XEvent *ev);
 void xinit(int argc, char *argv[]);
 void initdc(void);
 void xclose(void);
 void getmonitors(void);
 void drawrectangle(Pixmap pix, XRectangle rect, unsigned int color);
-void drawtext(Drawable pix, XftColor *color, int x, int y, const char *text, int len);
+void drawtext(XftDraw *draw, XftColor *color, int x, int y, const char *text, int len);
 void drawtriangle(Drawable pix, unsigned int color, int x, int y, int direction);
 void drawshadows(Pixmap pix, XRectangle rect, unsigned long top, unsigned long bot);
 void drawseparator(Drawable pix, int x, int y, int w, int dash);
 void commitdrawing(Window win, Pixmap pix, XRectangle rect);
+void presentdrawing(Window win, Pixmap pix);
 void copypixmap(Pixmap to, Pixmap from, XRectangle rect);
 void grabkey(KeyCode key, unsigned int mods);
 void ungrab(void);
@@ -277,16 +325,25 @@ void grabkeysync(KeyCode key);
 void grabbuttonsync(unsigned int button);
 int grab(int grabwhat);
 int textwidth(const char *text, int len);
+void measureitem(struct Item *item);
+void textadvances(const char *text, size_t beg, size_t len, int *x);
+int textadvance(const char *text, size_t len);
 void translatecoordinates(Window win, short *x, short *y);
 void querypointer(int *x, int *y);
 XRectangle getselmon(XRectangle *rect);
+void settitle(Window win, const char *title);
 Window createwindow(XRectangle *rect, int type, const char *title);
 Pixmap createpixmap(XRectangle rect, Window win);
+XftDraw *createdraw(Pixmap pix);
+void changedraw(XftDraw *draw, Pixmap pix);
+void freedraw(XftDraw *draw);
 KeyCode getkeycode(const char *str);
 int isresourcetrue(const char *val);
 char *getresource(const char *res, const char *name, const char *class);
-void geticon(Window win, char *file, Pixmap *icon, Pixmap *mask);
-void drawicon(Pixmap pix, Pixmap icon, Pixmap mask, int x, int y);
+void initicons(void (*fn)(void *), void *arg);
+int geticon(const char *file, int *icon);
+void puticon(int icon);
+void drawicon(XftDraw *draw, int icon, int x, int y);
 
 /* prompt.c */
 int getoperation(struct Prompt *prompt, XKeyEvent *ev, char *buf, size_t bufsize, KeySym *ksym, int *len);
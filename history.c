@@ -0,0 +1,593 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ctrlmenu.h"
+
+#define CACHEDIR        "ctrlmenu"              /* directory in $XDG_CACHE_HOME */
+#define FRECENCY        "frecency"              /* frecency database file */
+#define FRECMAGIC       "ctrlfrc1"
+#define FRECSLOTS       1024                    /* initial number of slots in the table */
+#define FRECLOG         256                     /* number of logged launches before compacting */
+#define FRECMAXCOUNT    10000                   /* total number of launches before aging */
+#define HOUR            (60 * 60)
+#define DAY             (24 * HOUR)
+#define WEEK            (7 * DAY)
+
+/*
+ * The frecency database is a file memory-mapped at load time.  It is
+ * composed of a header, an open-addressing hash table of launch counts
+ * (as of the last compaction), and an append-only log of the launches
+ * done since then.  Loading the database does not parse it: the table
+ * is used in place, and only the log (which is bounded) is gathered
+ * into an in-memory table.  Once the log is long enough, the database
+ * is compacted into a new file with the log folded into the table.
+ */
+struct FrecHeader {
+	char magic[8];
+	uint32_t nslots;                /* number of slots in the table; a power of two */
+	uint32_t nused;                 /* number of slots in use */
+};
+
+struct FrecSlot {
+	uint64_t key;                   /* hash of the item path; 0 for empty slots */
+	uint32_t count;                 /* number of launches */
+	uint32_t pad;
+	int64_t last;                   /* time of the last launch */
+};
+
+struct FrecRecord {
+	uint64_t key;
+	int64_t time;
+};
+
+static struct {
+	char *path;                     /* path to the database file */
+	int fd;                         /* database file opened for appending */
+	void *map;                      /* database file mapped into memory */
+	size_t mapsize;
+	struct FrecSlot *slots;         /* table in the mapped file */
+	size_t nslots;
+	struct FrecSlot *log;           /* table of the logged launches */
+	size_t nlogslots;
+	size_t nlog;                    /* number of logged launches */
+} frec = {
+	.path = NULL,
+	.fd = -1,
+	.map = NULL,
+};
+
+/* get path of file in the cache directory, creating the directory if needed */
+static char *
+getcachepath(const char *name)
+{
+	char path[PATH_MAX];
+	char *dir, *home;
+	int n;
+
+	if ((dir = getenv("XDG_CACHE_HOME")) != NULL && *dir != '\0')
+		n = snprintf(path, sizeof(path), "%s/%s", dir, CACHEDIR);
+	else if ((home = getenv("HOME")) != NULL && *home != '\0')
+		n = snprintf(path, sizeof(path), "%s/.cache/%s", home, CACHEDIR);
+	else
+		return NULL;
+	if (n < 0 || (size_t)n >= sizeof(path))
+		return NULL;
+	if (mkdir(path, 0700) == -1 && errno == ENOENT) {
+		/* create $HOME/.cache too */
+		*strrchr(path, '/') = '\0';
+		(void)mkdir(path, 0700);
+		path[strlen(path)] = '/';
+		(void)mkdir(path, 0700);
+	}
+	if ((size_t)snprintf(path + n, sizeof(path) - n, "/%s", name) >= sizeof(path) - n)
+		return NULL;
+	return estrdup(path);
+}
+
+static uint64_t
+hashbytes(uint64_t hash, const char *s, size_t len)
+{
+	while (len-- > 0) {
+		hash ^= (unsigned char)*s++;
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+static uint64_t
+hashpath(struct Item *item)
+{
+	uint64_t hash;
+
+	if (item == NULL)
+		return 0xCBF29CE484222325ULL;           /* FNV-1a offset basis */
+	hash = hashpath(item->caller);
+	if (item->name != NULL)
+		hash = hashbytes(hash, item->name, strlen(item->name));
+	return hashbytes(hash, "/", 1);
+}
+
+/* get key identifying the item by its path (its chain of callers and its name) */
+uint64_t
+itemkey(struct Item *item)
+{
+	uint64_t key;
+
+	key = hashpath(item);
+	return (key == 0) ? 1 : key;
+}
+
+/* get slot for key on a table, or the empty slot where it should be */
+static struct FrecSlot *
+getslot(struct FrecSlot *slots, size_t nslots, uint64_t key)
+{
+	size_t i;
+
+	for (i = key & (nslots - 1); slots[i].key != 0 && slots[i].key != key; i = (i + 1) & (nslots - 1))
+		;
+	return &slots[i];
+}
+
+/* add launches into a table, which must have an empty slot left */
+static int
+addslot(struct FrecSlot *slots, size_t nslots, uint64_t key, uint32_t count, int64_t last)
+{
+	struct FrecSlot *slot;
+	int new;
+
+	slot = getslot(slots, nslots, key);
+	new = (slot->key == 0);
+	slot->key = key;
+	slot->count += count;
+	slot->last = (last > slot->last) ? last : slot->last;
+	return new;
+}
+
+static void
+unloadfrecency(void)
+{
+	if (frec.map != NULL)
+		munmap(frec.map, frec.mapsize);
+	frec.map = NULL;
+	frec.mapsize = 0;
+	frec.slots = NULL;
+	frec.nslots = 0;
+	frec.nlog = 0;
+	if (frec.log != NULL)
+		memset(frec.log, 0, frec.nlogslots * sizeof(*frec.log));
+}
+
+/* map the database, if it has changed since last time */
+void
+loadfrecency(void)
+{
+	struct FrecHeader *hdr;
+	struct FrecRecord *rec;
+	struct stat sb;
+	size_t off, n, i;
+
+	if (frec.path == NULL && (frec.path = getcachepath(FRECENCY)) == NULL)
+		return;
+	if (frec.fd == -1 && (frec.fd = open(frec.path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+		warn("%s", frec.path);
+		free(frec.path);
+		frec.path = NULL;
+		return;
+	}
+	if (fstat(frec.fd, &sb) == -1 || (size_t)sb.st_size == frec.mapsize)
+		return;
+	unloadfrecency();
+	if ((size_t)sb.st_size < sizeof(*hdr))
+		return;
+	frec.map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, frec.fd, 0);
+	if (frec.map == MAP_FAILED) {
+		frec.map = NULL;
+		return;
+	}
+	frec.mapsize = sb.st_size;
+	hdr = frec.map;
+	off = sizeof(*hdr) + hdr->nslots * sizeof(*frec.slots);
+	if (memcmp(hdr->magic, FRECMAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->nslots == 0 || (hdr->nslots & (hdr->nslots - 1)) != 0 ||
+	    off > frec.mapsize) {
+		warnx("%s: invalid frecency database", frec.path);
+		unloadfrecency();
+		return;
+	}
+	frec.slots = (struct FrecSlot *)(hdr + 1);
+	frec.nslots = hdr->nslots;
+
+	/* gather the log into the in-memory table */
+	rec = (struct FrecRecord *)((char *)frec.map + off);
+	n = (frec.mapsize - off) / sizeof(*rec);
+	if (frec.nlogslots < 2 * n + 2 * FRECLOG) {
+		for (frec.nlogslots = FRECLOG; frec.nlogslots < 2 * n + 2 * FRECLOG; frec.nlogslots *= 2)
+			;
+		free(frec.log);
+		frec.log = ecalloc(frec.nlogslots, sizeof(*frec.log));
+	}
+	for (i = 0; i < n; i++)
+		(void)addslot(frec.log, frec.nlogslots, rec[i].key, 1, rec[i].time);
+	frec.nlog = n;
+}
+
+/* get the frecency rank of the item with the given key */
+int
+frecency(uint64_t key, time_t now)
+{
+	struct FrecSlot *slot;
+	uint32_t count;
+	int64_t last;
+
+	count = 0;
+	last = 0;
+	if (frec.slots != NULL && (slot = getslot(frec.slots, frec.nslots, key))->key != 0) {
+		count += slot->count;
+		last = slot->last;
+	}
+	if (frec.log != NULL && (slot = getslot(frec.log, frec.nlogslots, key))->key != 0) {
+		count += slot->count;
+		last = (slot->last > last) ? slot->last : last;
+	}
+	if (count == 0)
+		return 0;
+	if (now - last < HOUR)
+		return count * 16;
+	if (now - last < DAY)
+		return count * 8;
+	if (now - last < WEEK)
+		return count * 2;
+	return count;
+}
+
+/* log the launch of an item */
+void
+logfrecency(struct Item *item)
+{
+	struct FrecHeader hdr;
+	struct FrecRecord rec;
+	struct stat sb;
+	char *slots;
+
+	loadfrecency();
+	if (frec.fd == -1)
+		return;
+	if (fstat(frec.fd, &sb) == -1)
+		return;
+	if (sb.st_size == 0) {
+		/* new database; write its header and empty table */
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, FRECMAGIC, sizeof(hdr.magic));
+		hdr.nslots = FRECSLOTS;
+		slots = ecalloc(FRECSLOTS, sizeof(*frec.slots));
+		if (write(frec.fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+		    write(frec.fd, slots, FRECSLOTS * sizeof(*frec.slots)) != (ssize_t)(FRECSLOTS * sizeof(*frec.slots)))
+			warn("%s", frec.path);
+		free(slots);
+	}
+	rec.key = itemkey(item);
+	rec.time = time(NULL);
+	if (write(frec.fd, &rec, sizeof(rec)) != (ssize_t)sizeof(rec))
+		warn("%s", frec.path);
+	if (frec.log != NULL && 2 * (frec.nlog + 1) < frec.nlogslots) {
+		(void)addslot(frec.log, frec.nlogslots, rec.key, 1, rec.time);
+		frec.nlog++;
+	}
+}
+
+/* fold the log into the table of the database, if the log is long enough */
+void
+compactfrecency(void)
+{
+	struct FrecHeader hdr;
+	struct FrecSlot *slots, *p;
+	size_t nslots, nused, i;
+	uint64_t total;
+	char tmp[PATH_MAX];
+	int fd, aging;
+
+	loadfrecency();
+	if (frec.map == NULL || frec.nlog < FRECLOG)
+		return;
+	nused = ((struct FrecHeader *)frec.map)->nused;
+	for (nslots = frec.nslots; nslots < 2 * (nused + frec.nlog); nslots *= 2)
+		;
+	slots = ecalloc(nslots, sizeof(*slots));
+	nused = 0;
+	total = 0;
+	for (i = 0; i < frec.nslots + frec.nlogslots; i++) {
+		p = (i < frec.nslots) ? &frec.slots[i] : &frec.log[i - frec.nslots];
+		if (p->key == 0)
+			continue;
+		nused += addslot(slots, nslots, p->key, p->count, p->last);
+		total += p->count;
+	}
+
+	/* age the counts, so old launches eventually vanish */
+	aging = (total > FRECMAXCOUNT);
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, FRECMAGIC, sizeof(hdr.magic));
+	hdr.nslots = nslots;
+	hdr.nused = nused;
+	if (aging) {
+		for (i = 0; i < nslots; i++) {
+			if (slots[i].key == 0)
+				continue;
+			slots[i].count = slots[i].count * 9 / 10;
+		}
+		/* rehash without the entries aged out */
+		p = slots;
+		slots = ecalloc(nslots, sizeof(*slots));
+		hdr.nused = 0;
+		for (i = 0; i < nslots; i++)
+			if (p[i].key != 0 && p[i].count > 0)
+				hdr.nused += addslot(slots, nslots, p[i].key, p[i].count, p[i].last);
+		free(p);
+	}
+
+	(void)snprintf(tmp, sizeof(tmp), "%s.tmp", frec.path);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1) {
+		warn("%s", tmp);
+		goto done;
+	}
+	if (write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+	    write(fd, slots, nslots * sizeof(*slots)) != (ssize_t)(nslots * sizeof(*slots))) {
+		warn("%s", tmp);
+		close(fd);
+		unlink(tmp);
+		goto done;
+	}
+	close(fd);
+	if (rename(tmp, frec.path) == -1) {
+		warn("%s", frec.path);
+		unlink(tmp);
+		goto done;
+	}
+
+	/* reopen the new database */
+	unloadfrecency();
+	close(frec.fd);
+	frec.fd = -1;
+	loadfrecency();
+done:
+	free(slots);
+}
+
+/*
+ * The input history is a text file with one entry per line, and an
+ * index file with the offset of each line as a 64-bit integer.  The
+ * number of entries is got from the size of the index, and recalling
+ * an entry reads its offset and then its line; so no file is read as
+ * a whole, however long the history is.  Once there are more than
+ * twice HISTMAX entries, the files are rewritten with the last HISTMAX.
+ */
+#define HISTORY         "history"               /* input history file */
+#define HISTINDEX       "history.idx"           /* offsets of the lines in the history file */
+#define HISTMAX         10000                   /* number of entries kept at compaction */
+
+static struct {
+	char *path;                     /* path to the history file */
+	char *idxpath;                  /* path to the index file */
+	int fd;                         /* history file opened for appending */
+	int idxfd;                      /* index file opened for appending */
+	size_t nents;                   /* number of entries */
+	off_t size;                     /* size of the history file */
+} hist = {
+	.path = NULL,
+	.idxpath = NULL,
+	.fd = -1,
+	.idxfd = -1,
+};
+
+/* rebuild the index from the history file, if they are not consistent */
+static void
+reindexhistory(void)
+{
+	struct stat sb, idxsb;
+	uint64_t off, last;
+	char buf[BUFSIZ];
+	ssize_t n, i;
+
+	if (fstat(hist.fd, &sb) == -1 || fstat(hist.idxfd, &idxsb) == -1)
+		return;
+	hist.size = sb.st_size;
+	hist.nents = idxsb.st_size / sizeof(off);
+	if (hist.size == 0 && idxsb.st_size == 0)
+		return;
+	if (idxsb.st_size % sizeof(off) == 0 && hist.nents > 0 &&
+	    pread(hist.idxfd, &last, sizeof(last), idxsb.st_size - sizeof(last)) == (ssize_t)sizeof(last) &&
+	    last < (uint64_t)hist.size &&
+	    pread(hist.fd, buf, 1, hist.size - 1) == 1 && buf[0] == '\n')
+		return;
+
+	/* an append was interrupted; index the complete lines again */
+	if (ftruncate(hist.idxfd, 0) == -1) {
+		warn("%s", hist.idxpath);
+		return;
+	}
+	hist.nents = 0;
+	for (off = 0, last = 0; (n = pread(hist.fd, buf, sizeof(buf), off)) > 0; off += n) {
+		for (i = 0; i < n; i++) {
+			if (buf[i] != '\n')
+				continue;
+			if (write(hist.idxfd, &last, sizeof(last)) != (ssize_t)sizeof(last)) {
+				warn("%s", hist.idxpath);
+				return;
+			}
+			hist.nents++;
+			last = off + i + 1;
+		}
+	}
+	hist.size = last;
+	if (ftruncate(hist.fd, hist.size) == -1)
+		warn("%s", hist.path);
+}
+
+/* open the history, and get its number of entries */
+size_t
+loadhistory(void)
+{
+	if (hist.path == NULL) {
+		if ((hist.path = getcachepath(HISTORY)) == NULL)
+			return 0;
+		if ((hist.idxpath = getcachepath(HISTINDEX)) == NULL) {
+			free(hist.path);
+			hist.path = NULL;
+			return 0;
+		}
+	}
+	if (hist.fd == -1 && (hist.fd = open(hist.path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+		warn("%s", hist.path);
+		return 0;
+	}
+	if (hist.idxfd == -1 && (hist.idxfd = open(hist.idxpath, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+		warn("%s", hist.idxpath);
+		return 0;
+	}
+	reindexhistory();
+	return hist.nents;
+}
+
+/* read the nth entry of the history into buf; return NULL on error */
+char *
+gethistory(size_t n, char *buf, size_t size)
+{
+	uint64_t off[2];
+	size_t len;
+
+	if (hist.fd == -1 || hist.idxfd == -1 || n >= hist.nents || size == 0)
+		return NULL;
+	if (n + 1 < hist.nents) {
+		if (pread(hist.idxfd, off, sizeof(off), n * sizeof(*off)) != (ssize_t)sizeof(off))
+			return NULL;
+	} else {
+		if (pread(hist.idxfd, off, sizeof(*off), n * sizeof(*off)) != (ssize_t)sizeof(*off))
+			return NULL;
+		off[1] = hist.size;
+	}
+	if (off[1] <= off[0])
+		return NULL;
+	len = off[1] - off[0] - 1;              /* strip the newline */
+	if (len >= size)
+		len = size - 1;
+	if (pread(hist.fd, buf, len, off[0]) != (ssize_t)len)
+		return NULL;
+	buf[len] = '\0';
+	return buf;
+}
+
+/* append an entry to the history, unless it is equal to the last one; get the number of entries */
+size_t
+addhistory(const char *text)
+{
+	char buf[BUFSIZ];
+	uint64_t off;
+	size_t len;
+
+	if (loadhistory() > 0 && gethistory(hist.nents - 1, buf, sizeof(buf)) != NULL && strcmp(buf, text) == 0)
+		return hist.nents;
+	if (hist.fd == -1 || hist.idxfd == -1)
+		return 0;
+	if ((len = strlen(text)) == 0 || strchr(text, '\n') != NULL)
+		return hist.nents;
+	/* write the offset first, so an interrupted append is detected at load */
+	off = hist.size;
+	if (write(hist.idxfd, &off, sizeof(off)) != (ssize_t)sizeof(off)) {
+		warn("%s", hist.idxpath);
+		return hist.nents;
+	}
+	if (write(hist.fd, text, len) != (ssize_t)len || write(hist.fd, "\n", 1) != 1) {
+		warn("%s", hist.path);
+		return hist.nents;
+	}
+	hist.size += len + 1;
+	hist.nents++;
+	return hist.nents;
+}
+
+/* copy the tail of fd from offset into a new file at path */
+static int
+copytail(int fd, off_t from, const char *path)
+{
+	char buf[BUFSIZ];
+	ssize_t n;
+	int newfd;
+
+	if ((newfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1)
+		return -1;
+	while ((n = pread(fd, buf, sizeof(buf), from)) > 0) {
+		if (write(newfd, buf, n) != n) {
+			close(newfd);
+			return -1;
+		}
+		from += n;
+	}
+	close(newfd);
+	return (n < 0) ? -1 : 0;
+}
+
+/* drop the oldest entries of the history, if there are too many */
+void
+compacthistory(void)
+{
+	char tmp[PATH_MAX], idxtmp[PATH_MAX];
+	uint64_t *offs, base;
+	size_t i;
+	int fd;
+
+	if (loadhistory() <= 2 * HISTMAX)
+		return;
+	offs = ecalloc(HISTMAX, sizeof(*offs));
+	if (pread(hist.idxfd, offs, HISTMAX * sizeof(*offs), (hist.nents - HISTMAX) * sizeof(*offs)) != (ssize_t)(HISTMAX * sizeof(*offs)))
+		goto done;
+	base = offs[0];
+	for (i = 0; i < HISTMAX; i++)
+		offs[i] -= base;
+	(void)snprintf(tmp, sizeof(tmp), "%s.tmp", hist.path);
+	(void)snprintf(idxtmp, sizeof(idxtmp), "%s.tmp", hist.idxpath);
+	if (copytail(hist.fd, base, tmp) == -1) {
+		warn("%s", tmp);
+		unlink(tmp);
+		goto done;
+	}
+	if (rename(tmp, hist.path) == -1) {
+		warn("%s", hist.path);
+		unlink(tmp);
+		goto done;
+	}
+	close(hist.fd);
+	hist.fd = -1;
+
+	/*
+	 * The history file has been replaced; if writing the new index
+	 * fails, the next load rebuilds it from the history file.
+	 */
+	if ((fd = open(idxtmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1) {
+		warn("%s", idxtmp);
+		(void)ftruncate(hist.idxfd, 0);
+	} else if (write(fd, offs, HISTMAX * sizeof(*offs)) != (ssize_t)(HISTMAX * sizeof(*offs))) {
+		warn("%s", idxtmp);
+		close(fd);
+		unlink(idxtmp);
+		(void)ftruncate(hist.idxfd, 0);
+	} else if (close(fd) == -1 || rename(idxtmp, hist.idxpath) == -1) {
+		warn("%s", idxtmp);
+		unlink(idxtmp);
+		(void)ftruncate(hist.idxfd, 0);
+	}
+	close(hist.idxfd);
+	hist.idxfd = -1;
+	(void)loadhistory();
+done:
+	free(offs);
+}
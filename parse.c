@@ -1,10 +1,16 @@
-#include <sys/wait.h>
+#include <sys/uio.h>
 
 #include <err.h>
+#include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ctrlmenu.h"
@@ -12,6 +18,10 @@
 #define BUFSIZE 1024
 #define KSYMBUF 32
 #define UTFMAX  4
+#define GENREAD (64 * 1024)     /* maximum bytes read from a generator at once */
+#define GENMAX  (16 * 1024 * 1024) /* maximum bytes a generator may output */
+#define CALCDELAY 150           /* milliseconds typing must pause before evaluating */
+#define MARKERLEN (sizeof(CALCMARKER) - 1)
 
 /* token types */
 enum {
@@ -53,6 +63,57 @@ struct ParseData {
 	size_t toksize;
 };
 
+/* output of a generator script, cached for the pipe meta-entries with a ttl */
+TAILQ_HEAD(CacheQueue, Cache);
+struct Cache {
+	TAILQ_ENTRY(Cache) entries;
+	char *script;                   /* the script, which is the cache key */
+	char *out;                      /* output of its last complete run, or NULL */
+	size_t len;
+	time_t time;                    /* when the output was generated */
+	int refreshing;                 /* whether it is being run in the background */
+};
+
+/* generator script running asynchronously */
+struct Generator {
+	struct ItemQueue *itemq;        /* queue the generated items are appended to, or NULL */
+	struct Item *caller;            /* pipe meta-entry whose script is running */
+	void (*fn)(struct Generator *, struct Item *, int, void *);
+	void *arg;
+	char *buf;                      /* output not yet parsed (a partial line) */
+	size_t len;
+	size_t size;
+	struct Cache *cache;            /* cache entry to save the output into, or NULL */
+	char *out;                      /* whole output, for the cache */
+	size_t outlen;
+	size_t outsize;
+	size_t total;                   /* bytes output so far */
+	pid_t pid;
+	int fd;
+};
+
+/* calculator coprocess, answering one expression at a time */
+static struct {
+	pid_t pid;                      /* 0 if not running */
+	int in, out;                    /* its standard input and output */
+	char *buf;                      /* output not yet read as an answer */
+	size_t len;
+	size_t size;
+	int pending;                    /* sentinels written whose marker is not read yet */
+	char *expr;                     /* expression being evaluated, or NULL */
+	char *next;                     /* expression to be sent when due, or NULL */
+	char *last;                     /* last expression answered, or NULL */
+	struct timespec due;            /* when next is sent */
+	struct timespec deadline;       /* when expr times out */
+	void (*fn)(const char *, struct ItemQueue *, void *);
+	void *arg;
+} calc;
+
+static struct CacheQueue cacheq = TAILQ_HEAD_INITIALIZER(cacheq);
+
+extern char **environ;
+static volatile sig_atomic_t flushcache = 0;
+
 static void parselistrec(struct ParseData *parse, struct ItemQueue *itemq, struct Item *parent, struct AcceleratorQueue *accq);
 
 static int
@@ -316,6 +377,25 @@ parsename(struct ParseData *parse, struct Item *item)
 	item->len = strlen(item->name);
 }
 
+/* parse a number of seconds in an extension */
+static int
+parseseconds(struct ParseData *parse, const char *s, const char *what, int *secs)
+{
+	long n;
+	char *end;
+
+	n = strtol(s, &end, 10);
+	while (isblank((unsigned char)*end))
+		end++;
+	if (n < 0 || n > INT_MAX / 1000 || end == s || *end != '\0') {
+		warnx("%s:%zu: parse error: invalid %s \"%s\"", parse->filename, parse->lineno, what, s);
+		parse->error = 1;
+		return -1;
+	}
+	*secs = n;
+	return 0;
+}
+
 static void
 parsebraces(struct ParseData *parse, struct Item *item, struct AcceleratorQueue *accq)
 {
@@ -337,6 +417,14 @@ parsebraces(struct ParseData *parse, struct Item *item, struct AcceleratorQueue
 			file = p + 1;
 		} else if (*p == '!') {
 			accstr = p + 1;
+		} else if (*p == '@') {
+			if (parseseconds(parse, p + 1, "cache time", &item->ttl) == -1) {
+				return;
+			}
+		} else if (*p == '%') {
+			if (parseseconds(parse, p + 1, "timeout", &item->timeout) == -1) {
+				return;
+			}
 		} else {
 			desc = p;
 			break;
@@ -420,6 +508,7 @@ parsecmd(struct ParseData *parse, struct Item *item)
 {
 	consume(parse, TOK_CMD);
 	item->cmd = estrdup(parse->toktext);
+	item->argv = splitcmd(item->cmd);
 }
 
 static struct Item *
@@ -438,10 +527,12 @@ parseitemrec(struct ParseData *parse, struct Item *parent, struct AcceleratorQue
 		.altkey = 0,
 		.acc = NULL,
 		.genscript = NULL,
+		.argv = NULL,
+		.ttl = 0,
+		.timeout = 0,
 		.flags = 0,
 		.file = NULL,
-		.icon = None,
-		.mask = None,
+		.icon = 0,
 	};
 	TAILQ_INIT(&item->children);
 	if (check(parse, TOK_CMD)) {
@@ -468,6 +559,9 @@ parseitemrec(struct ParseData *parse, struct Item *parent, struct AcceleratorQue
 			consume(parse, TOK_OPENCURLY);
 			parselistrec(parse, &item->children, item, accq);
 			consume(parse, TOK_CLOSECURLY);
+		} else if (item->name != NULL) {
+			/* a terminal entry without a command runs its name */
+			item->argv = splitcmd(item->name);
 		}
 	}
 	consume(parse, TOK_NEWLINE);
@@ -509,10 +603,10 @@ parsepipeditem(char *buf, struct Item *caller)
 		.altkey = 0,
 		.acc = NULL,
 		.genscript = NULL,
+		.argv = NULL,
 		.flags = ITEM_ISGEN,
 		.file = NULL,
-		.icon= None,
-		.mask= None,
+		.icon = 0,
 	};
 	TAILQ_INIT(&item->children);
 	if ((s = strchr(buf, '\t')) != NULL) {
@@ -533,114 +627,559 @@ parsepipeditem(char *buf, struct Item *caller)
 	return item;
 }
 
-static void
-parsepipe(struct ParseData *parse, struct ItemQueue *itemq, struct Item *caller)
+/* parse a line output by a generator; blank lines generate no item */
+static struct Item *
+parsepipeline(char *s, struct Item *caller)
 {
-	struct Item *item;
-	ssize_t linelen;
-	size_t linesize = 0;
-	char *line = NULL;
-	char *s;
+	while (isblank(*(unsigned char *)s))
+		s++;
+	if (*s == '\n' || *s == '\0')
+		return NULL;
+	s[strcspn(s, "\n")] = '\0';
+	return parsepipeditem(s, caller);
+}
 
-	TAILQ_INIT(itemq);
-	while ((linelen = getline(&line, &linesize, parse->fp)) != -1) {
-		s = line;
-		while (isblank(*(unsigned char *)s))
-			s++;
-		if (*s == '\n' || *s == '\0')
-			continue;
-		s[strcspn(s, "\n")] = '\0';
-		if ((item = parsepipeditem(s, caller)) == NULL)
-			break;
-		TAILQ_INSERT_TAIL(itemq, item, entries);
-	}
+static void
+sighup(int sig)
+{
+	(void)sig;
+	flushcache = 1;
 }
 
+/* drop the cached output of the generators when SIGHUP is received */
 void
-readpipe(FILE *fp, struct ItemQueue *itemq, struct Item *caller)
+initcache(void)
 {
-	struct ParseData parse;
-	char buf[BUFSIZE];
+	struct sigaction sa;
 
-	buf[0] = '\0';
-	parse = (struct ParseData){
-		.fp = fp,
-		.filename = "(generated)",
-		.lineno = 0,
-		.error = 0,
-		.eof = 0,
-		.ispipe = 1,
+	sa.sa_handler = sighup;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGHUP, &sa, NULL) == -1) {
+		err(1, "sigaction");
+	}
+}
 
-		.bufdata = buf,
-		.bufsize = BUFSIZE,
+/* get the cache entry of a script */
+static struct Cache *
+getcache(const char *script)
+{
+	struct Cache *cache;
 
-		.toktype = TOK_NONE,
-		.toktext = NULL,
-		.toksize = 0,
-		.alt = NULL,
+	if (flushcache) {
+		flushcache = 0;
+		TAILQ_FOREACH(cache, &cacheq, entries) {
+			free(cache->out);
+			cache->out = NULL;
+		}
+	}
+	TAILQ_FOREACH(cache, &cacheq, entries)
+		if (strcmp(cache->script, script) == 0)
+			return cache;
+	cache = emalloc(sizeof(*cache));
+	*cache = (struct Cache){
+		.script = estrdup(script),
+		.out = NULL,
+		.len = 0,
+		.time = 0,
+		.refreshing = 0,
 	};
-	parsepipe(&parse, itemq, caller);
-	fclose(fp);
-	free(parse.toktext);
-	wait(NULL);
-	if (parse.error) {
-		cleanitems(itemq);
+	TAILQ_INSERT_HEAD(&cacheq, cache, entries);
+	return cache;
+}
+
+/* generate the items of a pipe meta-entry from its cached output */
+static void
+parsecache(struct Cache *cache, struct ItemQueue *itemq, struct Item *caller)
+{
+	struct Item *item;
+	char *out, *s, *nl;
+
+	out = estrndup(cache->out, cache->len);
+	for (s = out; *s != '\0'; s = nl + 1) {
+		if ((nl = strchr(s, '\n')) == NULL)
+			nl = s + strlen(s) - 1;
+		else
+			*nl = '\0';
+		if ((item = parsepipeline(s, caller)) != NULL) {
+			TAILQ_INSERT_TAIL(itemq, item, entries);
+		}
 	}
+	free(out);
 }
 
-void
-genmenu(struct ItemQueue *itemq, struct Item *caller)
+/* the script may have left children behind holding the pipe; they are killed too */
+static void
+closegenerator(struct Generator *gen)
 {
-	FILE *fp;
-	int fd[2];
+	delwatch(gen->fd);
+	close(gen->fd);
+	if (gen->pid != -1)
+		killchild(gen->pid);
+	if (gen->cache != NULL && gen->itemq == NULL)
+		gen->cache->refreshing = 0;
+	free(gen->out);
+	free(gen->buf);
+	free(gen);
+}
 
-	epipe(fd);
-	if (efork() == 0) {      /* child */
-		close(fd[0]);
-		if (fd[1] != STDOUT_FILENO)
-			edup2(fd[1], STDOUT_FILENO);
-		eexecshell(caller->genscript, NULL);
-		exit(1);
+/*
+ * Read what the generator has output, and append the items of its
+ * complete lines.  Once the generator has expired or output more than
+ * GENMAX bytes, it is killed after this read, as if it had exited (but
+ * its output is not cached).
+ */
+static void
+readgenerator(int fd, int expired, void *p)
+{
+	struct Generator *gen;
+	struct Item *item, *first;
+	size_t total;
+	ssize_t n;
+	char *s, *end, *nl;
+	int done;
+
+	gen = (struct Generator *)p;
+	done = 0;
+	for (total = 0; total < GENREAD; total += n) {
+		if (gen->size - gen->len < BUFSIZE + 1) {
+			gen->size = (gen->size == 0) ? BUFSIZE * 4 : gen->size * 2;
+			gen->buf = erealloc(gen->buf, gen->size);
+		}
+		n = read(fd, gen->buf + gen->len, gen->size - gen->len - 1);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0) {
+			expired = 0;
+			done = 1;
+			break;
+		}
+		gen->total += n;
+		if (gen->cache != NULL) {
+			while (gen->outlen + n > gen->outsize) {
+				gen->outsize = (gen->outsize == 0) ? BUFSIZE * 4 : gen->outsize * 2;
+				gen->out = erealloc(gen->out, gen->outsize);
+			}
+			memcpy(gen->out + gen->outlen, gen->buf + gen->len, n);
+			gen->outlen += n;
+		}
+		gen->len += n;
+	}
+
+	/* a generator keeping its pipe full never lets read() fail with EAGAIN */
+	if (!done && expired) {
+		warnx("%s: timed out", gen->caller->name);
+		done = 1;
+	} else if (!done && gen->total > GENMAX) {
+		warnx("%s: too much output", gen->caller->name);
+		expired = 1;
+		done = 1;
+	}
+	if (done && !expired && gen->cache != NULL) {
+		free(gen->cache->out);
+		gen->cache->out = gen->out;
+		gen->cache->len = gen->outlen;
+		gen->cache->time = time(NULL);
+		gen->out = NULL;
 	}
-	if ((fp = fdopen(fd[0], "r")) == NULL) {
-		warnx("could open file pointer");
+	if (gen->itemq == NULL) {
+		/* refreshing the cache; nobody waits for the items */
+		gen->len = 0;
+		if (done)
+			closegenerator(gen);
 		return;
 	}
+
+	/* the last line may have no newline; parse it only at end of file */
+	first = NULL;
+	end = gen->buf + gen->len;
+	for (s = gen->buf; s < end; s = nl + 1) {
+		if ((nl = memchr(s, '\n', end - s)) == NULL) {
+			if (!done)
+				break;
+			nl = end;
+		}
+		*nl = '\0';
+		if ((item = parsepipeline(s, gen->caller)) == NULL)
+			continue;
+		TAILQ_INSERT_TAIL(gen->itemq, item, entries);
+		if (first == NULL) {
+			first = item;
+		}
+	}
+	if (s < end) {
+		gen->len = end - s;
+		memmove(gen->buf, s, gen->len);
+	} else {
+		gen->len = 0;
+	}
+	(*gen->fn)(gen, first, done, gen->arg);
+	if (done) {
+		closegenerator(gen);
+	}
+}
+
+static struct Generator *
+rungenerator(struct ItemQueue *itemq, struct Item *caller, void (*fn)(struct Generator *, struct Item *, int, void *), void *arg, struct Cache *cache)
+{
+	struct Generator *gen;
+	char *argv[] = { SHELL, "-c", caller->genscript, NULL };
+	int fd[2];
+	int timeout;
+
+	epipe(fd);
+	gen = emalloc(sizeof(*gen));
+	*gen = (struct Generator){
+		.itemq = itemq,
+		.caller = caller,
+		.fn = fn,
+		.arg = arg,
+		.buf = NULL,
+		.len = 0,
+		.size = 0,
+		.cache = cache,
+		.out = NULL,
+		.outlen = 0,
+		.outsize = 0,
+		.total = 0,
+		.fd = fd[0],
+	};
+	(void)fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+	(void)fcntl(fd[0], F_SETFL, O_NONBLOCK);
+
+	/* if the script cannot be started, its pipe is read to the end at once */
+	if ((gen->pid = startchild(CHILD_GENERATOR, argv, NULL, (int[3]){ -1, fd[1], -1 })) == -1)
+		warn("%s", SHELL);
+	else
+		setchildfds(gen->pid, -1, gen->fd, -1);
 	close(fd[1]);
-	readpipe(fp, itemq, caller);
+	timeout = (caller->timeout > 0) ? caller->timeout : config.timeout;
+	addwatch(fd[0], timeout * 1000, readgenerator, gen);
+	return gen;
+}
+
+/*
+ * Start the script of a pipe meta-entry without waiting for it.  The
+ * items are appended to itemq as lines are output, while the X event
+ * loop runs; fn(gen, first, done, arg) is called with the first item
+ * appended (or NULL), and with done set once the script is over (after
+ * which the generator no longer exists).
+ *
+ * If the entry has a ttl and its script has been run before, the items
+ * are generated from the cached output at once, and NULL is returned.
+ * The cache is then refreshed in the background if it is older than
+ * the ttl.
+ */
+struct Generator *
+startgenerator(struct ItemQueue *itemq, struct Item *caller, void (*fn)(struct Generator *, struct Item *, int, void *), void *arg)
+{
+	struct Cache *cache;
+
+	TAILQ_INIT(itemq);
+	if (caller->ttl <= 0)
+		return rungenerator(itemq, caller, fn, arg, NULL);
+	cache = getcache(caller->genscript);
+	if (cache->out == NULL)
+		return rungenerator(itemq, caller, fn, arg, cache);
+	parsecache(cache, itemq, caller);
+	if (!cache->refreshing && time(NULL) - cache->time >= caller->ttl) {
+		cache->refreshing = 1;
+		(void)rungenerator(NULL, caller, NULL, NULL, cache);
+	}
+	return NULL;
 }
 
+/* kill a running generator; the items it has generated so far are kept */
 void
-runcalc(struct ItemQueue *itemq, char *text)
+stopgenerator(struct Generator *gen)
+{
+	closegenerator(gen);
+}
+
+/* kill the calculator; it is started again by the next expression */
+static void
+closecalc(void)
+{
+	delwatch(calc.out);
+	close(calc.in);
+	close(calc.out);
+	killchild(calc.pid);
+	calc.pid = 0;
+	calc.len = 0;
+	calc.pending = 0;
+}
+
+/* the environment of the calculator; bc(1) must not wrap long numbers */
+static char **
+calcenviron(void)
+{
+	static char **envp = NULL;
+	size_t n, i, j;
+
+	if (envp != NULL)
+		return envp;
+	for (n = 0; environ[n] != NULL; n++)
+		;
+	envp = ecalloc(n + 2, sizeof(*envp));
+	for (i = j = 0; i < n; i++)
+		if (strncmp(environ[i], "BC_LINE_LENGTH=", 15) != 0)
+			envp[j++] = environ[i];
+	envp[j++] = "BC_LINE_LENGTH=0";
+	envp[j] = NULL;
+	return envp;
+}
+
+static int
+startcalc(void)
 {
-	FILE *fp[2];
+	char *argv[] = { calculator, NULL };
 	int fd[2][2];
 
 	epipe(fd[0]);
 	epipe(fd[1]);
-	if (efork() == 0) {      /* child */
+	(void)fcntl(fd[0][1], F_SETFD, FD_CLOEXEC);
+	(void)fcntl(fd[1][0], F_SETFD, FD_CLOEXEC);
+
+	/* errors answer an expression as results do */
+	calc.pid = startchild(CHILD_CALCULATOR, argv, calcenviron(), (int[3]){ fd[0][0], fd[1][1], fd[1][1] });
+	close(fd[0][0]);
+	close(fd[1][1]);
+	if (calc.pid == -1) {
+		warn("%s", calculator);
+		calc.pid = 0;
 		close(fd[0][1]);
 		close(fd[1][0]);
-		if (fd[0][0] != STDIN_FILENO)
-			edup2(fd[0][0], STDIN_FILENO);
-		if (fd[1][1] != STDOUT_FILENO)
-			edup2(fd[1][1], STDOUT_FILENO);
-		eexeccmd(calculator, NULL);
-		exit(1);
+		return -1;
 	}
-	close(fd[0][0]);
-	close(fd[1][1]);
-	if ((fp[0] = fdopen(fd[0][1], "w")) == NULL) {
-		warnx("could open file pointer");
+	calc.in = fd[0][1];
+	calc.out = fd[1][0];
+	setchildfds(calc.pid, calc.in, calc.out, calc.out);
+	(void)fcntl(calc.out, F_SETFL, O_NONBLOCK);
+	return 0;
+}
+
+/*
+ * Pass the result of the expression being evaluated, or no result if
+ * answer is NULL or blank.  An answer of several lines (as to "1;2")
+ * is joined into one.
+ */
+static void
+answercalc(char *answer)
+{
+	struct ItemQueue itemq;
+	struct Item *item;
+	size_t len;
+	char *s;
+
+	TAILQ_INIT(&itemq);
+	if (answer != NULL) {
+		len = strlen(answer);
+		while (len > 0 && answer[len - 1] == '\n')
+			answer[--len] = '\0';
+		for (s = answer; (s = strchr(s, '\n')) != NULL; s++)
+			*s = ' ';
+	}
+	if (answer != NULL && (item = parsepipeline(answer, NULL)) != NULL)
+		TAILQ_INSERT_TAIL(&itemq, item, entries);
+	if (calc.fn != NULL)
+		(*calc.fn)(calc.expr, &itemq, calc.arg);
+	cleanitems(&itemq);
+	free(calc.last);
+	calc.last = calc.expr;
+	calc.expr = NULL;
+}
+
+static void readcalc(int fd, int expired, void *p);
+
+/* watch the calculator until the next expression is due or the current one times out */
+static void
+armcalc(void)
+{
+	int timeout;
+
+	if (calc.pid == 0 && calc.next == NULL)
+		return;
+	if (calc.pid == 0 && startcalc() == -1) {
+		free(calc.next);
+		calc.next = NULL;
 		return;
 	}
-	if ((fp[1] = fdopen(fd[1][0], "r")) == NULL) {
-		warnx("could open file pointer");
+	timeout = -1;
+	if (calc.expr != NULL)
+		timeout = timeleft(&calc.deadline);
+	if (calc.expr == NULL && calc.next != NULL)
+		timeout = timeleft(&calc.due);
+	delwatch(calc.out);
+	addwatch(calc.out, (timeout == -1) ? 0 : max(timeout, 1), readcalc, NULL);
+}
+
+/* write s and a newline to the calculator */
+static int
+writecalc(const char *s)
+{
+	struct iovec iov[2];
+	size_t len;
+
+	len = strlen(s);
+	iov[0] = (struct iovec){ .iov_base = (void *)s, .iov_len = len };
+	iov[1] = (struct iovec){ .iov_base = "\n", .iov_len = 1 };
+	if (writev(calc.in, iov, 2) != (ssize_t)(len + 1))
+		return -1;
+	return 0;
+}
+
+/*
+ * Send the next expression, once it is due and the previous one is
+ * answered, followed by the sentinel (if any) making the calculator
+ * print the marker that ends the answer.  A calculator that has not
+ * answered an expression which timed out (it is computing still, or
+ * waits for the end of a block) is stuck; it is killed only now, as
+ * another expression needs it.
+ */
+static void
+sendcalc(void)
+{
+	if (calc.expr != NULL || calc.next == NULL || timeleft(&calc.due) != 0)
+		return;
+	if (calc.pending > 0)
+		closecalc();
+	calc.expr = calc.next;
+	calc.next = NULL;
+	calc.len = 0;
+	if (calc.pid == 0 && startcalc() == -1) {
+		answercalc(NULL);
 		return;
 	}
-	fprintf(fp[0], "%s\n", text);
-	fclose(fp[0]);
-	readpipe(fp[1], itemq, NULL);
+	if (writecalc(calc.expr) == -1 || (calcsentinel != NULL && writecalc(calcsentinel) == -1)) {
+		warnx("%s: could not write expression", calculator);
+		closecalc();
+		answercalc(NULL);
+		return;
+	}
+	calc.pending++;
+	setdeadline(&calc.deadline, config.timeout * 1000);
+}
+
+/*
+ * Find the end of the next answer in the output of the calculator, or
+ * NULL, and set *skip to the length of what ends it: the marker line,
+ * or the newline if no sentinel is written and an answer is a line.
+ */
+static char *
+findanswer(size_t *skip)
+{
+	char *s, *end;
+
+	if (calcsentinel == NULL) {
+		*skip = 1;
+		return memchr(calc.buf, '\n', calc.len);
+	}
+	*skip = MARKERLEN + 1;
+	end = calc.buf + calc.len;
+	for (s = calc.buf; (s = memchr(s, CALCMARKER[0], end - s)) != NULL; s++)
+		if ((size_t)(end - s) > MARKERLEN && memcmp(s, CALCMARKER "\n", MARKERLEN + 1) == 0)
+			return s;
+	return NULL;
+}
+
+/*
+ * Read the answer of the calculator: all it outputs until the marker,
+ * which ends the answer even if it is empty (as to an assignment) or
+ * of several lines; without a sentinel, the next line it outputs.
+ * Output not answering an expression is dropped.
+ * An expression not answered in time gets no result, but the
+ * calculator is not killed.
+ */
+static void
+readcalc(int fd, int expired, void *p)
+{
+	size_t n, skip;
+	ssize_t r;
+	char *s;
+
+	(void)p;
+	for (;;) {
+		if (calc.size - calc.len < BUFSIZE + 1) {
+			calc.size = (calc.size == 0) ? BUFSIZE : calc.size * 2;
+			calc.buf = erealloc(calc.buf, calc.size);
+		}
+		r = read(fd, calc.buf + calc.len, calc.size - calc.len - 1);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (r <= 0) {
+			warnx("%s: exited", calculator);
+			closecalc();
+			if (calc.expr != NULL)
+				answercalc(NULL);
+			break;
+		}
+		calc.len += r;
+		if (calc.pending == 0) {
+			calc.len = 0;
+		}
+	}
+	while (calc.pending > 0 && (s = findanswer(&skip)) != NULL) {
+		/* the answer of an expression which timed out is dropped */
+		*s = '\0';
+		if (--calc.pending == 0 && calc.expr != NULL)
+			answercalc(calc.buf);
+		n = s + skip - calc.buf;
+		memmove(calc.buf, calc.buf + n, calc.len - n);
+		calc.len -= n;
+	}
+	if (calc.expr == NULL && calc.len > MARKERLEN) {
+		/* keep only what may begin the marker */
+		memmove(calc.buf, calc.buf + calc.len - MARKERLEN, MARKERLEN);
+		calc.len = MARKERLEN;
+	}
+	if (calc.expr != NULL && expired && timeleft(&calc.deadline) == 0) {
+		warnx("%s: timed out", calculator);
+		answercalc(NULL);
+	}
+	sendcalc();
+	armcalc();
+}
+
+/*
+ * Evaluate expr in the calculator, which is kept running between
+ * expressions.  The expression is sent once no other one has been
+ * asked for in CALCDELAY milliseconds; fn(expr, itemq, arg) is then
+ * called with the results in itemq (which is emptied after fn returns,
+ * unless fn takes its items).
+ */
+void
+evalcalc(const char *expr, void (*fn)(const char *, struct ItemQueue *, void *), void *arg)
+{
+	calc.fn = fn;
+	calc.arg = arg;
+	if (calc.next != NULL && strcmp(calc.next, expr) == 0)
+		return;
+	if (calc.next == NULL && calc.expr != NULL && strcmp(calc.expr, expr) == 0)
+		return;
+	if (calc.next == NULL && calc.expr == NULL && calc.last != NULL && strcmp(calc.last, expr) == 0)
+		return;
+	free(calc.next);
+	calc.next = estrdup(expr);
+	setdeadline(&calc.due, CALCDELAY);
+	armcalc();
+}
+
+/* forget the expressions asked for; the calculator is kept running */
+void
+cancelcalc(void)
+{
+	free(calc.next);
+	free(calc.last);
+	calc.next = NULL;
+	calc.last = NULL;
+	calc.fn = NULL;
+	calc.arg = NULL;
 }
 
 void
@@ -659,14 +1198,13 @@ cleanitems(struct ItemQueue *itemq)
 			free(item->acc);
 		if (item->genscript != NULL)
 			free(item->genscript);
+		free(item->argv);
 		if (item->file != NULL)
 			free(item->file);
 		cleanitems(&item->children);
 		TAILQ_REMOVE(itemq, item, entries);
-		if (item->icon != None)
-			XFreePixmap(dpy, item->icon);
-		if (item->mask != None)
-			XFreePixmap(dpy, item->mask);
+		if (item->icon != 0)
+			puticon(item->icon);
 		free(item);
 	}
 }
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "ctrlmenu.h"
 
@@ -10,6 +11,17 @@
 #define DEFWIDTH     600        /* default width */
 #define DEFHEIGHT    20         /* default height for each text line */
 #define GROUPWIDTH   150        /* width of space for group name */
+#define INDEXSIZE    256        /* initial number of entries in the index */
+
+/* scores for fuzzy matching */
+#define SCORE_MATCH             16      /* each matching character */
+#define SCORE_GAP_START         -3      /* first unmatched character after a match */
+#define SCORE_GAP_EXTENSION     -1      /* further unmatched characters */
+#define BONUS_BOUNDARY          8       /* match at the beginning of a word */
+#define BONUS_CAMEL             7       /* match at a lower-to-upper case or letter-to-digit change */
+#define BONUS_CONSECUTIVE       4       /* match right after the previous one */
+#define BONUS_FIRST             2       /* multiplier of the bonus of the first character */
+#define BONUS_FRECENCY          8       /* most an entry is raised for being launched often */
 
 #define ISMOTION(x) ((x) == CTRLBOL || (x) == CTRLEOL || (x) == CTRLLEFT \
                     || (x) == CTRLRIGHT || (x) == CTRLWLEFT || (x) == CTRLWRIGHT)
@@ -19,12 +31,59 @@
                      || (x) == CTRLDELRIGHT || (x) == CTRLDELWORD || (x) == INSERT)
 #define ISUNDO(x) ((x) == CTRLUNDO || (x) == CTRLREDO)
 
+/* classes of matching items, in the order they are listed */
+enum {
+	MATCH_GROUP,                    /* group name begins with the text */
+	MATCH_GROUPMIDDLE,              /* group name contains the text */
+	MATCH_ITEM,                     /* item name begins with the text */
+	MATCH_ITEMMIDDLE,               /* item name contains the text */
+	MATCH_LAST,
+	MATCH_NONE = MATCH_LAST
+};
+
+/*
+ * Flat index of the items searched by the runner.  Each entry is
+ * either a group (an item with children) or a selectable item; their
+ * names are stored contiguously in an arena, and their attributes are
+ * stored in parallel arrays, so searching does not chase the pointers
+ * of the item tree.
+ */
+struct Index {
+	struct Item **items;            /* item of each entry */
+	char *names;                    /* arena of nul-terminated names */
+	char *fold;                     /* case-folded copy of the arena */
+	const char *search;             /* arena to be searched (names or fold) */
+	size_t *offs;                   /* offset of the name of each entry in the arena */
+	size_t *lens;                   /* length of the name of each entry */
+	int *groups;                    /* group id of each entry, or -1 for top-level entries */
+	char *leaf;                     /* whether each entry is a selectable item */
+	uint64_t *keys;                 /* frecency key of each selectable entry */
+	int *rank;                      /* frecency rank of each selectable entry */
+	size_t *groupents;              /* entry of each group */
+	size_t nents, entsize;
+	size_t ngroups, groupsize;
+	size_t namelen, namesize;
+};
+
+/* entry scored by the fuzzy matcher */
+struct Scored {
+	int score;
+	size_t ent;
+};
+
 TAILQ_HEAD(UndoQueue, Undo);
 struct Undo {
 	TAILQ_ENTRY(Undo) entries;
 	char *text;
 };
 
+/* what a row of the list shows */
+struct Row {
+	struct Item *item;              /* item on the row, or NULL if blank */
+	struct Item *group;             /* group name on the row, or NULL */
+	int selected;
+};
+
 struct Prompt {
 	int *inited;                     /* whether prompt is in use */
 
@@ -34,12 +93,15 @@ struct Prompt {
 	size_t cursor;                  /* position of the cursor in the input field */
 	size_t select;                  /* position of the selection in the input field*/
 	size_t file;                    /* position of the beginning of the file name */
+	int textx[INPUTSIZ + 1];        /* width of the first i bytes of the text */
+	char measured[INPUTSIZ];        /* text textx was computed for */
+	unsigned long fontid;           /* font textx was computed with */
 
-	// TODO: implement history
-	FILE *histfp;                   /* pointer to history file */
-	char **history;                 /* array of history entries */
-	size_t histindex;               /* index to the selected entry in the array */
-	size_t histsize;                /* how many entries there are in the array */
+	/* input history */
+	char histtext[INPUTSIZ];        /* text typed before navigating the history */
+	char histentry[INPUTSIZ];       /* selected entry of the history */
+	size_t histindex;               /* index to the selected entry in the history */
+	size_t histsize;                /* how many entries there are in the history */
 
 	/* undo history */
 	struct UndoQueue undoq;         /* undo list */
@@ -51,6 +113,8 @@ struct Prompt {
 	struct ItemQueue matchq;        /* list of matching items */
 	struct ItemQueue deferq;        /* list of matching items */
 	struct ItemQueue genq;          /* list of matching items */
+	struct Generator **gens;        /* generators still running */
+	size_t ngens, gensize;
 	struct ItemQueue results;       /* results of calculator */
 	struct Item *firstmatch;        /* first item that matches input */
 	struct Item *listfirst;         /* first item that matches input to be listed */
@@ -59,6 +123,21 @@ struct Prompt {
 	struct Item open;               /* last item listed */
 	int nitems;                     /* number of items in itemarray */
 	int maxitems;                   /* maximum number of items in itemarray */
+	struct Row *rows;               /* what each row shows on the pixmap */
+	int redrawall;                  /* whether the pixmap must be drawn from scratch */
+
+	/* incremental matching */
+	struct Index index;             /* index of the items in the tree */
+	size_t *cands;                  /* entries matching prevtext, in tree order */
+	size_t ncands, candsize;
+	char *gclass;                   /* match class of each group */
+	size_t gclasssize;
+	char *mark;                     /* whether each entry contains the text */
+	int *gscore;                    /* fuzzy score of each group */
+	struct Scored *heap;            /* best maxitems fuzzy candidates */
+	size_t nheap;
+	char prevtext[INPUTSIZ];        /* text cands were computed for */
+	int refine;                     /* whether cands can be filtered again */
 
 	/* prompt geometry */
 	XRectangle rect;                /* width and height of xprompt */
@@ -66,6 +145,7 @@ struct Prompt {
 
 	/* drawables */
 	Pixmap pix;                     /* where to draw shapes on */
+	XftDraw *draw;                  /* where to draw text on */
 	Window win;                     /* xprompt window */
 
 	/* input context */
@@ -75,6 +155,26 @@ struct Prompt {
 	int composing;                  /* whether user is composing text */
 };
 
+/* update the widths of the prefixes of the input text from where it last changed */
+static void
+measureinput(struct Prompt *prompt)
+{
+	size_t i, len;
+
+	i = 0;
+	if (prompt->fontid == dc.fontid) {
+		while (prompt->text[i] != '\0' && prompt->text[i] == prompt->measured[i])
+			i++;
+		while (i > 0 && ((unsigned char)prompt->text[i] & 0xC0) == 0x80)
+			i--;
+	}
+	prompt->fontid = dc.fontid;
+	len = i + strlen(prompt->text + i);
+	memcpy(prompt->measured + i, prompt->text + i, len - i + 1);
+	prompt->textx[0] = 0;
+	textadvances(prompt->text, i, len, prompt->textx);
+}
+
 /* draw the text on input field, return position of the cursor */
 static void
 drawinput(struct Prompt *prompt, int copy)
@@ -85,6 +185,7 @@ drawinput(struct Prompt *prompt, int copy)
 	int xtext, ytext;
 	int widthpre, widthsel;
 
+	measureinput(prompt);
 	minpos = min(prompt->cursor, prompt->select);
 	maxpos = max(prompt->cursor, prompt->select);
 
@@ -99,9 +200,9 @@ drawinput(struct Prompt *prompt, int copy)
 	xtext = PADDING;
 	ytext = (config.itemheight + dc.face->height) / 2;
 	if (minpos > 0) {
-		widthpre = textwidth(prompt->text, minpos);
+		widthpre = prompt->textx[minpos];
 		drawtext(
-			prompt->pix,
+			prompt->draw,
 			&dc.colors[COLOR_RUNNER].foreground,
 			xtext,
 			ytext,
@@ -117,16 +218,16 @@ drawinput(struct Prompt *prompt, int copy)
 	rect.x = xtext;
 	if (prompt->composing) {
 		len = strlen(prompt->ictext);
-		widthsel = textwidth(prompt->ictext, len);
+		widthsel = textadvance(prompt->ictext, len);
 		rect.width = widthsel;
 		drawrectangle(prompt->pix, rect, dc.colors[COLOR_RUNNER].foreground.pixel);
-		drawtext(prompt->pix, &dc.colors[COLOR_RUNNER].background, xtext, ytext, prompt->ictext, len);
+		drawtext(prompt->draw, &dc.colors[COLOR_RUNNER].background, xtext, ytext, prompt->ictext, len);
 	} else if (maxpos - minpos > 0) {
 		len = maxpos - minpos;
-		widthsel = textwidth(prompt->text + minpos, len);
+		widthsel = prompt->textx[maxpos] - prompt->textx[minpos];
 		rect.width = widthsel;
 		drawrectangle(prompt->pix, rect, dc.colors[COLOR_RUNNER].foreground.pixel);
-		drawtext(prompt->pix, &dc.colors[COLOR_RUNNER].background, xtext, ytext, prompt->text + minpos, len);
+		drawtext(prompt->draw, &dc.colors[COLOR_RUNNER].background, xtext, ytext, prompt->text + minpos, len);
 	} else {
 		widthsel = 0;
 	}
@@ -134,37 +235,59 @@ drawinput(struct Prompt *prompt, int copy)
 	/* draw text after selection */
 	xtext += widthsel;
 	len = strlen(prompt->text + maxpos);
-	drawtext(prompt->pix, &dc.colors[COLOR_RUNNER].foreground, xtext, ytext, prompt->text + maxpos, len);
+	drawtext(prompt->draw, &dc.colors[COLOR_RUNNER].foreground, xtext, ytext, prompt->text + maxpos, len);
 
 	/* draw cursor rectangle */
-	rect.x = PADDING + widthpre + ((prompt->composing && prompt->caret) ? textwidth(prompt->ictext, prompt->caret) : 0);
+	rect.x = PADDING + widthpre + ((prompt->composing && prompt->caret) ? textadvance(prompt->ictext, prompt->caret) : 0);
 	rect.y = (config.itemheight - dc.face->height) / 2;
 	rect.width = 1;
 	rect.height = config.itemheight - PADDING;
 	drawrectangle(prompt->pix, rect, dc.colors[COLOR_RUNNER].foreground.pixel);
 
 	if (copy) {
-		redrawprompt(prompt);
+		presentdrawing(prompt->win, prompt->pix);
 	}
 }
 
+/* draw the rows of the list whose content changed */
 static void
 drawitems(struct Prompt *prompt)
 {
 	XftColor *color, *altcolor;
 	XRectangle rect;
 	struct Item *item, *prev;
+	struct Row row;
 	unsigned long pixel;
-	size_t len;
 	int i, ytext;
 
 	rect.x = 0;
 	rect.height = config.itemheight;
 	rect.width = prompt->rect.width;
 	prev = NULL;
-	for (i = 0; i < prompt->nitems; i++) {
-		item = prompt->itemarray[i];
-		if (item == prompt->selitem) {
+	for (i = 0; i < prompt->maxitems; i++) {
+		item = (i < prompt->nitems) ? prompt->itemarray[i] : NULL;
+		row = (struct Row){
+			.item = item,
+			.group = NULL,
+			.selected = (item != NULL && item == prompt->selitem),
+		};
+		if (item != NULL && item->caller != NULL && (prev == NULL || item->caller != prev->caller))
+			row.group = item->caller;
+		prev = item;
+
+		/* the row of the typed text changes as the text does */
+		if (row.item != &prompt->open &&
+		    row.item == prompt->rows[i].item &&
+		    row.group == prompt->rows[i].group &&
+		    row.selected == prompt->rows[i].selected)
+			continue;
+		prompt->rows[i] = row;
+		rect.y = (i + 1) * config.itemheight + SEPARATOR_HEIGHT;
+		if (item == NULL) {
+			drawrectangle(prompt->pix, rect, dc.colors[COLOR_RUNNER].background.pixel);
+			continue;
+		}
+		if (row.selected) {
 			pixel = dc.colors[COLOR_RUNNER].selbackground.pixel;
 			color = &dc.colors[COLOR_RUNNER].selforeground;
 			altcolor = &dc.colors[COLOR_RUNNER].altselforeground;
@@ -173,12 +296,11 @@ drawitems(struct Prompt *prompt)
 			color = &dc.colors[COLOR_RUNNER].foreground;
 			altcolor = &dc.colors[COLOR_RUNNER].altforeground;
 		}
-		rect.y = (i + 1) * config.itemheight + SEPARATOR_HEIGHT;
 		drawrectangle(prompt->pix, rect, pixel);
 		ytext = rect.y + (config.itemheight + dc.face->ascent) / 2;
-		if (item->caller != NULL && (prev == NULL || item->caller != prev->caller)) {
+		if (row.group != NULL) {
 			drawtext(
-				prompt->pix,
+				prompt->draw,
 				altcolor,
 				PADDING,
 				ytext,
@@ -186,37 +308,43 @@ drawitems(struct Prompt *prompt)
 				strlen(item->caller->name)
 			);
 		}
-		len = strlen(item->name);
 		drawtext(
-			prompt->pix,
+			prompt->draw,
 			color,
 			GROUPWIDTH,
 			ytext,
 			item->name,
-			len
+			item->len
 		);
 		if (item->desc != NULL) {
+			measureitem(item);
 			drawtext(
-				prompt->pix,
+				prompt->draw,
 				altcolor,
-				GROUPWIDTH + textwidth(item->name, len) + PADDING,
+				GROUPWIDTH + item->namew + PADDING,
 				ytext,
 				item->desc,
 				strlen(item->desc)
 			);
 		}
-		prev = item;
 	}
 }
 
 void
 drawprompt(struct Prompt *prompt)
 {
-	drawrectangle(prompt->pix, prompt->rect, dc.colors[COLOR_RUNNER].background.pixel);
-	drawseparator(prompt->pix, PADDING, config.itemheight + PADDING, prompt->rect.width - 2 * PADDING, 0);
+	int i;
+
+	if (prompt->redrawall) {
+		drawrectangle(prompt->pix, prompt->rect, dc.colors[COLOR_RUNNER].background.pixel);
+		drawseparator(prompt->pix, PADDING, config.itemheight + PADDING, prompt->rect.width - 2 * PADDING, 0);
+		for (i = 0; i < prompt->maxitems; i++)
+			prompt->rows[i] = (struct Row){ .item = NULL, .group = NULL, .selected = 0 };
+		prompt->redrawall = 0;
+	}
 	drawinput(prompt, 0);
 	drawitems(prompt);
-	redrawprompt(prompt);
+	presentdrawing(prompt->win, prompt->pix);
 }
 
 /* return location of next utf8 rune in the given direction (+1 or -1) */
@@ -512,70 +640,510 @@ addundo(struct Prompt *prompt, int editing)
 	}
 }
 
-/* check whether item matches text */
+/* add entry for item into the index, return its position */
+static size_t
+addentry(struct Index *index, struct Item *item, int group, int leaf)
+{
+	size_t len;
+
+	if (index->nents == index->entsize) {
+		index->entsize = (index->entsize == 0) ? INDEXSIZE : index->entsize * 2;
+		index->items = erealloc(index->items, index->entsize * sizeof(*index->items));
+		index->offs = erealloc(index->offs, index->entsize * sizeof(*index->offs));
+		index->lens = erealloc(index->lens, index->entsize * sizeof(*index->lens));
+		index->groups = erealloc(index->groups, index->entsize * sizeof(*index->groups));
+		index->leaf = erealloc(index->leaf, index->entsize * sizeof(*index->leaf));
+		index->keys = erealloc(index->keys, index->entsize * sizeof(*index->keys));
+		index->rank = erealloc(index->rank, index->entsize * sizeof(*index->rank));
+	}
+	len = strlen(item->name);
+	while (index->namelen + len + 1 > index->namesize) {
+		index->namesize = (index->namesize == 0) ? INDEXSIZE * 16 : index->namesize * 2;
+		index->names = erealloc(index->names, index->namesize);
+	}
+	memcpy(index->names + index->namelen, item->name, len + 1);
+	index->items[index->nents] = item;
+	index->offs[index->nents] = index->namelen;
+	index->lens[index->nents] = len;
+	index->groups[index->nents] = group;
+	index->leaf[index->nents] = leaf;
+	index->keys[index->nents] = leaf ? itemkey(item) : 0;
+	index->rank[index->nents] = 0;
+	index->namelen += len + 1;
+	return index->nents++;
+}
+
+/* add entry for group item into the index, return its group id */
 static int
-itemmatch(struct Item *item, const char *text, size_t textlen, int middle)
+addgroup(struct Index *index, struct Item *item, int group)
 {
-	if (textlen == 0)
-		return !middle;
-	return ((*config.fstrncmp)(item->name, text, textlen) == 0)
-	    != (middle && (*config.fstrstr)(item->name, text) != NULL);
+	if (index->ngroups == index->groupsize) {
+		index->groupsize = (index->groupsize == 0) ? INDEXSIZE : index->groupsize * 2;
+		index->groupents = erealloc(index->groupents, index->groupsize * sizeof(*index->groupents));
+	}
+	index->groupents[index->ngroups] = addentry(index, item, group, 0);
+	return index->ngroups++;
 }
 
-/* search for matching groups and fill matchq */
+/* add the groups and the selectable items in the tree into the index */
 static void
-searchgroups(struct Prompt *prompt, struct ItemQueue *itemq, int match, const char *text, size_t len, int middle)
+indexitems(struct Index *index, struct ItemQueue *itemq, int group)
 {
 	struct Item *item = NULL;
-	struct Item *prev;
 
-	prev = NULL;
 	TAILQ_FOREACH(item, itemq, entries) {
-		item->flags &= ~ITEM_FOUNDCALLER;
 		if (item->name == NULL) {
 			continue;
 		} else if (!TAILQ_EMPTY(&item->children)) {
-			searchgroups(prompt, &item->children, itemmatch(item, text, len, middle), text, len, middle);
-		} else if (item->genchildren != NULL && !TAILQ_EMPTY(item->genchildren)) {
-			searchgroups(prompt, item->genchildren, itemmatch(item, text, len, middle), text, len, middle);
-		} else if (match && item->genscript == NULL) {
-			if (prev == NULL)
-				TAILQ_INSERT_TAIL(&prompt->matchq, item, matches);
+			indexitems(index, &item->children, addgroup(index, item, group));
+		} else if (item->genchildren != NULL) {
+			/* its generator may be running still; keep it as a group */
+			indexitems(index, item->genchildren, addgroup(index, item, group));
+		} else if (item->genscript == NULL) {
+			(void)addentry(index, item, group, 1);
+		}
+	}
+}
+
+/* fold the names added to the index since offset, and fit the candidate arrays to it */
+static void
+growindex(struct Prompt *prompt, size_t from)
+{
+	struct Index *index;
+	size_t i;
+
+	index = &prompt->index;
+	index->search = index->names;
+	if (config.casefold) {
+		index->fold = erealloc(index->fold, index->namesize);
+		for (i = from; i < index->namelen; i++)
+			index->fold[i] = tolower((unsigned char)index->names[i]);
+		index->search = index->fold;
+	}
+	if (prompt->candsize < index->nents) {
+		prompt->candsize = index->entsize;
+		free(prompt->cands);
+		free(prompt->mark);
+		prompt->cands = ecalloc(prompt->candsize, sizeof(*prompt->cands));
+		prompt->mark = ecalloc(prompt->candsize, sizeof(*prompt->mark));
+	}
+	if (prompt->gclasssize < index->ngroups) {
+		prompt->gclasssize = index->groupsize;
+		free(prompt->gclass);
+		free(prompt->gscore);
+		prompt->gclass = ecalloc(prompt->gclasssize, sizeof(*prompt->gclass));
+		prompt->gscore = ecalloc(prompt->gclasssize, sizeof(*prompt->gscore));
+	}
+}
+
+/* rebuild the index; the candidates computed before are no longer valid */
+static void
+setindex(struct Prompt *prompt)
+{
+	struct Index *index;
+
+	index = &prompt->index;
+	index->nents = 0;
+	index->ngroups = 0;
+	index->namelen = 0;
+	indexitems(index, prompt->itemq, -1);
+	growindex(prompt, 0);
+	prompt->ncands = 0;
+	prompt->refine = 0;
+}
+
+/*
+ * Append the items generated for caller (from first on) into the
+ * index.  They are not in the candidates, so the next search must
+ * scan the whole index.
+ */
+static void
+addgenerated(struct Prompt *prompt, struct Item *caller, struct Item *first)
+{
+	struct Index *index;
+	struct Item *item;
+	time_t now;
+	size_t from, n;
+	int g;
+
+	index = &prompt->index;
+	for (g = 0; g < (int)index->ngroups; g++)
+		if (index->items[index->groupents[g]] == caller)
+			break;
+	if (g == (int)index->ngroups)
+		return;
+	from = index->namelen;
+	now = time(NULL);
+	for (item = first; item != NULL; item = TAILQ_NEXT(item, entries)) {
+		if (item->name == NULL)
+			continue;
+		n = addentry(index, item, g, 1);
+		index->rank[n] = frecency(index->keys[n], now);
+	}
+	growindex(prompt, from);
+	prompt->refine = 0;
+}
+
+/* get the frecency rank of each selectable entry */
+static void
+rankindex(struct Prompt *prompt)
+{
+	struct Index *index;
+	time_t now;
+	size_t n;
+
+	index = &prompt->index;
+	now = time(NULL);
+	for (n = 0; n < index->nents; n++) {
+		index->rank[n] = index->leaf[n] ? frecency(index->keys[n], now) : 0;
+	}
+}
+
+/* check whether the name of the nth entry begins with text */
+static int
+entryprefix(struct Index *index, size_t n, const char *text, size_t len)
+{
+	const char *name;
+
+	if (len == 0)
+		return 1;
+	if (index->lens[n] < len)
+		return 0;
+	name = index->search + index->offs[n];
+	return name[0] == text[0] && memcmp(name, text, len) == 0;
+}
+
+/* check whether the name of the nth entry contains text */
+static int
+entrycontains(struct Index *index, size_t n, const char *text, size_t len)
+{
+	if (len == 0)
+		return 1;
+	if (index->lens[n] < len)
+		return 0;
+	return memmem(index->search + index->offs[n], index->lens[n], text, len) != NULL;
+}
+
+/*
+ * Mark the entries whose names contain text.  Rather than testing each
+ * entry, sweep the whole arena with memmem(3), which is vectorized by
+ * the C library, and map each hit back to its entry.  Names are
+ * nul-terminated and the text contains no nul, so a hit never spans
+ * two entries; and hits come in arena order, so the entry is searched
+ * only after the previous hit.
+ */
+static void
+sweepindex(struct Prompt *prompt, const char *text, size_t len)
+{
+	struct Index *index;
+	const char *arena, *end, *p;
+	size_t lo, hi, mid;
+
+	index = &prompt->index;
+	if (len == 0) {
+		memset(prompt->mark, 1, index->nents);
+		return;
+	}
+	memset(prompt->mark, 0, index->nents);
+	arena = index->search;
+	end = arena + index->namelen;
+	lo = 0;
+	for (p = arena; p < end && (p = memmem(p, end - p, text, len)) != NULL; ) {
+		hi = index->nents;
+		while (hi - lo > 1) {
+			mid = lo + (hi - lo) / 2;
+			if (index->offs[mid] <= (size_t)(p - arena))
+				lo = mid;
 			else
-				TAILQ_INSERT_AFTER(&prompt->matchq, prev, item, matches);
-			item->flags |= ITEM_FOUNDCALLER;
-			prev = item;
+				hi = mid;
 		}
+		prompt->mark[lo] = 1;
+		if (++lo >= index->nents)
+			break;
+		p = arena + index->offs[lo];
 	}
 }
 
-/* search for matching items and fill matchq */
+/* whether scored entry a should be listed after scored entry b */
+static int
+worse(struct Scored *a, struct Scored *b)
+{
+	return a->score < b->score || (a->score == b->score && a->ent > b->ent);
+}
+
 static void
-searchitems(struct Prompt *prompt, struct ItemQueue *itemq, const char *text, size_t len, int middle)
+siftdown(struct Scored *heap, size_t nheap, size_t i)
 {
-	struct Item *item = NULL;
-	struct Item *prev;
+	struct Scored tmp;
+	size_t child;
 
-	prev = NULL;
-	TAILQ_FOREACH(item, itemq, entries) {
-		if (item->name == NULL) {
+	while ((child = 2 * i + 1) < nheap) {
+		if (child + 1 < nheap && worse(&heap[child + 1], &heap[child]))
+			child++;
+		if (!worse(&heap[child], &heap[i]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+static void
+siftup(struct Scored *heap, size_t i)
+{
+	struct Scored tmp;
+	size_t parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!worse(&heap[i], &heap[parent]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+/* keep the best maxitems entries in a heap whose root is the worst of them */
+static void
+pushscored(struct Prompt *prompt, int score, size_t ent)
+{
+	struct Scored scored;
+
+	scored = (struct Scored){ .score = score, .ent = ent };
+	if (prompt->nheap < (size_t)prompt->maxitems) {
+		prompt->heap[prompt->nheap] = scored;
+		siftup(prompt->heap, prompt->nheap++);
+	} else if (prompt->nheap > 0 && worse(&prompt->heap[0], &scored)) {
+		prompt->heap[0] = scored;
+		siftdown(prompt->heap, prompt->nheap, 0);
+	}
+}
+
+/* sort the heap from the best to the worst entry */
+static void
+sortheap(struct Prompt *prompt)
+{
+	struct Scored tmp;
+	size_t i;
+
+	for (i = prompt->nheap; i > 1; i--) {
+		tmp = prompt->heap[0];
+		prompt->heap[0] = prompt->heap[i - 1];
+		prompt->heap[i - 1] = tmp;
+		siftdown(prompt->heap, i - 1, 0);
+	}
+}
+
+/* get in which class of the match list each group lists its items */
+static void
+searchgroups(struct Prompt *prompt, int refine, const char *text, size_t len)
+{
+	struct Index *index;
+	size_t g, n;
+	int contains;
+
+	index = &prompt->index;
+	for (g = 0; g < index->ngroups; g++) {
+		n = index->groupents[g];
+		contains = refine ? entrycontains(index, n, text, len) : prompt->mark[n];
+		if (!contains)
+			prompt->gclass[g] = MATCH_NONE;
+		else if (entryprefix(index, n, text, len))
+			prompt->gclass[g] = MATCH_GROUP;
+		else
+			prompt->gclass[g] = MATCH_GROUPMIDDLE;
+	}
+}
+
+/*
+ * Filter the selectable entries of the index (or only the previous
+ * candidates, if refining) into the candidate array and fill matchq.
+ * The array of candidates keeps the tree order, so it can be filtered
+ * again when the user appends text to the input field; while matchq
+ * lists the candidates by class, after the most frecent of them.
+ */
+static void
+searchitems(struct Prompt *prompt, int refine, const char *text, size_t len)
+{
+	struct ItemQueue classq[MATCH_LAST];
+	struct Index *index;
+	struct Item *item;
+	size_t i, k, n, nents;
+	int class, group, contains;
+
+	index = &prompt->index;
+	for (class = 0; class < MATCH_LAST; class++)
+		TAILQ_INIT(&classq[class]);
+	if (!refine)
+		sweepindex(prompt, text, len);
+	searchgroups(prompt, refine, text, len);
+	prompt->nheap = 0;
+	nents = refine ? prompt->ncands : index->nents;
+	for (i = k = 0; i < nents; i++) {
+		n = refine ? prompt->cands[i] : i;
+		if (!index->leaf[n])
 			continue;
-		} else if (!TAILQ_EMPTY(&item->children)) {
-			if (item->flags & ITEM_FOUNDCALLER)
-				continue;
-			searchitems(prompt, &item->children, text, len, middle);
-		} else if (item->genchildren != NULL && !TAILQ_EMPTY(item->genchildren)) {
-			if (item->flags & ITEM_FOUNDCALLER)
+		if ((group = index->groups[n]) != -1 && prompt->gclass[group] != MATCH_NONE) {
+			class = prompt->gclass[group];
+		} else {
+			contains = refine ? entrycontains(index, n, text, len) : prompt->mark[n];
+			if (!contains)
 				continue;
-			searchitems(prompt, item->genchildren, text, len, middle);
-		} else if (item->genscript == NULL && itemmatch(item, text, len, middle)) {
-			if (prev == NULL)
-				TAILQ_INSERT_TAIL(&prompt->matchq, item, matches);
-			else
-				TAILQ_INSERT_AFTER(&prompt->matchq, prev, item, matches);
-			prev = item;
+			class = entryprefix(index, n, text, len) ? MATCH_ITEM : MATCH_ITEMMIDDLE;
+		}
+		prompt->cands[k++] = n;
+		TAILQ_INSERT_TAIL(&classq[class], index->items[n], matches);
+		if (index->rank[n] > 0) {
+			pushscored(prompt, index->rank[n], n);
+		}
+	}
+	prompt->ncands = k;
+	TAILQ_INIT(&prompt->matchq);
+	for (class = 0; class < MATCH_LAST; class++) {
+		TAILQ_CONCAT(&prompt->matchq, &classq[class], matches);
+	}
+
+	/* move the most frecent candidates to the top */
+	sortheap(prompt);
+	for (i = prompt->nheap; i > 0; i--) {
+		item = index->items[prompt->heap[i - 1].ent];
+		TAILQ_REMOVE(&prompt->matchq, item, matches);
+		TAILQ_INSERT_HEAD(&prompt->matchq, item, matches);
+	}
+}
+
+/* get bonus for matching the ith character of name */
+static int
+charbonus(const char *name, size_t i)
+{
+	unsigned char prev, curr;
+
+	if (i == 0)
+		return BONUS_BOUNDARY;
+	prev = name[i - 1];
+	curr = name[i];
+	if (!isalnum(prev) && (isalnum(curr) || curr >= 0x80))
+		return BONUS_BOUNDARY;
+	if ((islower(prev) && isupper(curr)) || (!isdigit(prev) && isdigit(curr)))
+		return BONUS_CAMEL;
+	return 0;
+}
+
+/*
+ * Get the fuzzy score of the nth entry, or -1 if its name does not
+ * contain the characters of text in sequence.  Find where the first
+ * occurrence of the sequence ends, go back to find the shortest window
+ * ending there, and score that window: matches at word boundaries and
+ * at the start of the name earn a bonus, which is carried along a run
+ * of consecutive matches; and unmatched characters inside the window
+ * are penalized.
+ */
+static int
+fuzzyscore(struct Index *index, size_t n, const char *text, size_t len)
+{
+	const char *name, *orig;
+	size_t namelen, beg, end, i, j;
+	int score, bonus, firstbonus, consecutive, ingap;
+
+	if (len == 0)
+		return 0;
+	if ((namelen = index->lens[n]) < len)
+		return -1;
+	name = index->search + index->offs[n];
+	orig = index->names + index->offs[n];
+	for (i = j = 0; i < namelen && j < len; i++)
+		if (name[i] == text[j])
+			j++;
+	if (j < len)
+		return -1;
+	end = i;
+	for (j = len; j > 0; )
+		if (name[--i] == text[j - 1])
+			j--;
+	beg = i;
+	score = 0;
+	firstbonus = 0;
+	consecutive = 0;
+	ingap = 0;
+	for (i = beg, j = 0; i < end; i++) {
+		if (j < len && name[i] == text[j]) {
+			score += SCORE_MATCH;
+			bonus = charbonus(orig, i);
+			if (consecutive == 0) {
+				firstbonus = bonus;
+			} else {
+				if (bonus >= BONUS_BOUNDARY && bonus > firstbonus)
+					firstbonus = bonus;
+				bonus = max(max(bonus, firstbonus), BONUS_CONSECUTIVE);
+			}
+			score += (j == 0) ? bonus * BONUS_FIRST : bonus;
+			consecutive++;
+			ingap = 0;
+			j++;
+		} else {
+			score += ingap ? SCORE_GAP_EXTENSION : SCORE_GAP_START;
+			consecutive = 0;
+			firstbonus = 0;
+			ingap = 1;
 		}
 	}
+	return score;
+}
+
+/*
+ * Get the bonus of a frecency rank: its binary logarithm, capped to
+ * half a matched character, so that frecency orders matches of about
+ * the same quality without raising a poor match over a good one.
+ */
+static int
+frecencybonus(int rank)
+{
+	int bonus;
+
+	for (bonus = 0; rank > 0 && bonus < BONUS_FRECENCY; rank >>= 1)
+		bonus++;
+	return bonus;
+}
+
+/*
+ * Filter the selectable entries of the index (or only the previous
+ * candidates, if refining) whose name or group name fuzzily matches
+ * text into the candidate array.  Only the best maxitems candidates
+ * are listed in matchq, from the best to the worst.
+ */
+static void
+searchfuzzy(struct Prompt *prompt, int refine, const char *text, size_t len)
+{
+	struct Index *index;
+	size_t g, i, k, n, nents;
+	int group, score;
+
+	index = &prompt->index;
+	for (g = 0; g < index->ngroups; g++)
+		prompt->gscore[g] = fuzzyscore(index, index->groupents[g], text, len);
+	prompt->nheap = 0;
+	nents = refine ? prompt->ncands : index->nents;
+	for (i = k = 0; i < nents; i++) {
+		n = refine ? prompt->cands[i] : i;
+		if (!index->leaf[n])
+			continue;
+		score = fuzzyscore(index, n, text, len);
+		if ((group = index->groups[n]) != -1)
+			score = max(score, prompt->gscore[group]);
+		if (score < 0)
+			continue;
+		prompt->cands[k++] = n;
+		pushscored(prompt, score + frecencybonus(index->rank[n]), n);
+	}
+	prompt->ncands = k;
+	sortheap(prompt);
+	TAILQ_INIT(&prompt->matchq);
+	for (i = 0; i < prompt->nheap; i++) {
+		TAILQ_INSERT_TAIL(&prompt->matchq, index->items[prompt->heap[i].ent], matches);
+	}
 }
 
 static void
@@ -594,6 +1162,26 @@ getgenerators(struct Prompt *prompt, struct ItemQueue *itemq)
 	}
 }
 
+/* get the previous (dir < 0) or next (dir > 0) entry of the input history */
+static char *
+navhist(struct Prompt *prompt, int dir)
+{
+	if (dir < 0) {
+		if (prompt->histindex == 0)
+			return NULL;
+		if (prompt->histindex == prompt->histsize)
+			memcpy(prompt->histtext, prompt->text, sizeof(prompt->histtext));
+		prompt->histindex--;
+	} else {
+		if (prompt->histindex >= prompt->histsize)
+			return NULL;
+		if (++prompt->histindex == prompt->histsize) {
+			return prompt->histtext;
+		}
+	}
+	return gethistory(prompt->histindex, prompt->histentry, sizeof(prompt->histentry));
+}
+
 /* navigate through the list of matching items; and fill item array */
 static void
 navmatchlist(struct Prompt *prompt, int direction)
@@ -640,24 +1228,87 @@ done:
 	prompt->nitems = i;
 }
 
+/* free the results of the calculator, which rows may still show */
+static void
+cleanresults(struct Prompt *prompt)
+{
+	if (TAILQ_EMPTY(&prompt->results))
+		return;
+	cleanitems(&prompt->results);
+	prompt->redrawall = 1;
+}
+
+/* list the results of the calculator */
+static void
+showresults(struct Prompt *prompt)
+{
+	struct Item *item;
+
+	TAILQ_INIT(&prompt->matchq);
+	TAILQ_FOREACH(item, &prompt->results, entries)
+		TAILQ_INSERT_TAIL(&prompt->matchq, item, matches);
+	item = TAILQ_FIRST(&prompt->matchq);
+	prompt->firstmatch = item;
+	prompt->listfirst = item;
+	prompt->selitem = NULL;
+	navmatchlist(prompt, 0);
+}
+
+/* list the answer of the calculator, if it is for the text still typed */
+static void
+promptcalc(const char *expr, struct ItemQueue *itemq, void *p)
+{
+	struct Prompt *prompt;
+
+	prompt = (struct Prompt *)p;
+	if (prompt->text[0] != '=' || strcmp(prompt->text + 1, expr) != 0)
+		return;
+	cleanresults(prompt);
+	TAILQ_CONCAT(&prompt->results, itemq, entries);
+	showresults(prompt);
+	drawprompt(prompt);
+}
+
 static void
 getmatchlist(struct Prompt *prompt)
 {
 	struct Item *item;
-	size_t len;
+	size_t len, prevlen, i;
+	int refine;
 	char *text;
+	char query[INPUTSIZ];
 
-	if (!TAILQ_EMPTY(&prompt->results))
+	if (prompt->text[0] == '=') {
+		/* the previous results are listed until the calculator answers */
+		evalcalc(prompt->text + 1, promptcalc, prompt);
+		showresults(prompt);
 		return;
-	TAILQ_INIT(&prompt->matchq);
+	}
+	cancelcalc();
+	cleanresults(prompt);
 	text = prompt->text;
 	len = strlen(prompt->text);
 	prompt->open.name = text;
 	prompt->open.len = len;
-	searchgroups(prompt, prompt->itemq, 0, text, len, 0);
-	searchgroups(prompt, prompt->itemq, 0, text, len, 1);
-	searchitems(prompt, prompt->itemq, text, len, 0);
-	searchitems(prompt, prompt->itemq, text, len, 1);
+	prompt->open.measured = 0;
+	for (i = 0; i <= len; i++)
+		query[i] = config.casefold ? tolower((unsigned char)text[i]) : text[i];
+
+	/*
+	 * An item matching (or fuzzily matching) the text also matches
+	 * any prefix of it.  If the user only appended text, filter the
+	 * previous candidates; otherwise (deletion, undo, editing in the
+	 * middle), scan all.
+	 */
+	prevlen = strlen(prompt->prevtext);
+	refine = prompt->refine && len >= prevlen && strncmp(prompt->prevtext, text, prevlen) == 0;
+	if (config.fuzzy)
+		searchfuzzy(prompt, refine, query, len);
+	else
+		searchitems(prompt, refine, query, len);
+	memcpy(prompt->prevtext, text, len + 1);
+	prompt->refine = 1;
+
 	TAILQ_INSERT_TAIL(&prompt->matchq, &prompt->open, matches);
 	item = TAILQ_FIRST(&prompt->matchq);
 	prompt->firstmatch = item;
@@ -711,6 +1362,7 @@ setprompt(struct ItemQueue *itemq, Window *win, int *inited)
 		.cursor = 0,
 		.select = 0,
 		.file = 0,
+		.fontid = 0,
 		.undocurr = NULL,
 		.itemq = itemq,
 		.firstmatch = NULL,
@@ -718,6 +1370,23 @@ setprompt(struct ItemQueue *itemq, Window *win, int *inited)
 		.listfirst = NULL,
 		.maxitems = config.runner_items,
 		.nitems = 0,
+		.redrawall = 1,
+		.index = { 0 },
+		.cands = NULL,
+		.ncands = 0,
+		.candsize = 0,
+		.gclass = NULL,
+		.gclasssize = 0,
+		.mark = NULL,
+		.gscore = NULL,
+		.heap = NULL,
+		.nheap = 0,
+		.refine = 0,
+		.gens = NULL,
+		.ngens = 0,
+		.gensize = 0,
+		.histindex = 0,
+		.histsize = 0,
 	};
 	caller = (struct Item){ .name = "?" };
 	prompt->open = (struct Item){
@@ -728,13 +1397,14 @@ setprompt(struct ItemQueue *itemq, Window *win, int *inited)
 		.acc = NULL,
 		.file = NULL,
 		.genscript = NULL,
-		.icon = None,
-		.mask = None,
+		.icon = 0,
 		.flags = ITEM_OPENER,
 	};
 	TAILQ_INIT(&prompt->open.children);
 	TAILQ_INIT(&prompt->results);
 	prompt->itemarray = ecalloc(prompt->maxitems, sizeof(*prompt->itemarray)),
+	prompt->rows = ecalloc(prompt->maxitems, sizeof(*prompt->rows));
+	prompt->heap = ecalloc(prompt->maxitems, sizeof(*prompt->heap));
 	prompt->rect.x = prompt->rect.y = 0;
 	prompt->rect.width = DEFWIDTH;
 	prompt->rect.height = SEPARATOR_HEIGHT + config.itemheight * (prompt->maxitems + 1);
@@ -805,14 +1475,44 @@ setprompt(struct ItemQueue *itemq, Window *win, int *inited)
 
 	*win = prompt->win;
 	prompt->pix = createpixmap(prompt->rect, prompt->win);
+	prompt->draw = createdraw(prompt->pix);
+	setindex(prompt);
 	drawprompt(prompt);
 
 	return prompt;
 }
 
+/* merge the items output by a generator into the match list */
+static void
+promptgenerated(struct Generator *gen, struct Item *first, int done, void *p)
+{
+	struct Prompt *prompt;
+	size_t i;
+
+	prompt = (struct Prompt *)p;
+	if (done) {
+		for (i = 0; i < prompt->ngens; i++) {
+			if (prompt->gens[i] == gen) {
+				prompt->gens[i] = prompt->gens[--prompt->ngens];
+				break;
+			}
+		}
+	}
+	if (first == NULL)
+		return;
+	addgenerated(prompt, first->caller, first);
+
+	/* do not move the list under the user; it is updated on the next key */
+	if (prompt->selitem != NULL)
+		return;
+	getmatchlist(prompt);
+	drawprompt(prompt);
+}
+
 void
 mapprompt(struct Prompt *prompt)
 {
+	struct Generator *gen;
 	struct Item *item;
 
 	if (*prompt->inited)
@@ -825,9 +1525,23 @@ mapprompt(struct Prompt *prompt)
 	TAILQ_INIT(&prompt->deferq);
 	getgenerators(prompt, prompt->itemq);
 	TAILQ_FOREACH(item, &prompt->deferq, defers) {
+		if (prompt->ngens == prompt->gensize) {
+			prompt->gensize = (prompt->gensize == 0) ? 8 : prompt->gensize * 2;
+			prompt->gens = erealloc(prompt->gens, prompt->gensize * sizeof(*prompt->gens));
+		}
 		item->genchildren = emalloc(sizeof(*item->genchildren));
-		genmenu(item->genchildren, item);
+		gen = startgenerator(item->genchildren, item, promptgenerated, prompt);
+		if (gen != NULL) {
+			prompt->gens[prompt->ngens++] = gen;
+		}
 	}
+	if (!TAILQ_EMPTY(&prompt->deferq))
+		setindex(prompt);
+	loadfrecency();
+	rankindex(prompt);
+	prompt->histsize = loadhistory();
+	prompt->histindex = prompt->histsize;
+	prompt->refine = 0;
 	getmatchlist(prompt);
 	drawprompt(prompt);
 	XMapWindow(dpy, prompt->win);
@@ -843,16 +1557,22 @@ unmapprompt(struct Prompt *prompt)
 		return;
 	*prompt->inited = 0;
 	XUnmapWindow(dpy, prompt->win);
+	XFlush(dpy);
+	while (prompt->ngens > 0)
+		stopgenerator(prompt->gens[--prompt->ngens]);
+	compactfrecency();
+	compacthistory();
 	cleanundo(prompt);
 	free(prompt->ictext);
 	prompt->ictext = NULL;
-	if (!TAILQ_EMPTY(&prompt->results))
-		cleanitems(&prompt->results);
+	cancelcalc();
+	cleanresults(prompt);
 	TAILQ_FOREACH(item, &prompt->deferq, defers) {
 		cleanitems(item->genchildren);
 		free(item->genchildren);
 		item->genchildren = NULL;
 	}
+	prompt->redrawall = 1;
 	XFlush(dpy);
 }
 
@@ -955,6 +1675,7 @@ promptkey(struct Prompt *prompt, char *buf, int len, int operation)
 {
 
 	struct Item *item;
+	char *s;
 
 	if (operation == CTRLNOTHING)
 		return;
@@ -974,29 +1695,25 @@ promptkey(struct Prompt *prompt, char *buf, int len, int operation)
 		unmapprompt(prompt);
 		return;
 	case CTRLENTER:
-		if (prompt->selitem == NULL && *prompt->text == '=') {
-			TAILQ_INIT(&prompt->matchq);
-			if (!TAILQ_EMPTY(&prompt->results))
-				cleanitems(&prompt->results);
-			TAILQ_INIT(&prompt->results);
-			runcalc(&prompt->results, prompt->text + 1);
-			TAILQ_FOREACH(item, &prompt->results, entries) {
-				TAILQ_INSERT_TAIL(&prompt->matchq, item, matches);
+		prompt->histsize = addhistory(prompt->text);
+		prompt->histindex = prompt->histsize;
+		if (*prompt->text == '=') {
+			/* the result is listed as it is typed; a selected one becomes the text */
+			if ((item = prompt->selitem) != NULL) {
+				prompt->text[0] = '\0';
+				prompt->cursor = 0;
+				insert(prompt, "=", 1);
+				insert(prompt, item->name, strlen(item->name));
+				getmatchlist(prompt);
 			}
-			item = TAILQ_FIRST(&prompt->matchq);
-			prompt->firstmatch = item;
-			prompt->listfirst = item;
-			prompt->selitem = NULL;
-			navmatchlist(prompt, 0);
 			break;
 		}
 		if (prompt->selitem == NULL) {
 			prompt->open.name = prompt->text;
 			prompt->open.cmd = prompt->text;
 			prompt->open.len = strlen(prompt->text);
+			prompt->open.measured = 0;
 			enteritem(&prompt->open);
-		} else if (!TAILQ_EMPTY(&prompt->results)) {
-			// TODO
 		} else {
 			enteritem(prompt->selitem);
 		}
@@ -1028,14 +1745,12 @@ promptkey(struct Prompt *prompt, char *buf, int len, int operation)
 	case CTRLUP:
 		/* FALLTHROUGH */
 	case CTRLDOWN:
-		// dir = (operation == CTRLUP) ? -1 : +1;
-		// if (prompt->histsize == 0)
-		// 	return;
-		// s = navhist(prompt, dir);
-		// if (s) {
-		// 	insert(prompt, NULL, 0 - prompt->cursor);
-		// 	insert(prompt, s, strlen(s));
-		// }
+		if ((s = navhist(prompt, (operation == CTRLUP) ? -1 : +1)) == NULL)
+			return;
+		prompt->text[0] = '\0';
+		prompt->cursor = 0;
+		insert(prompt, s, strlen(s));
+		getmatchlist(prompt);
 		break;
 	case CTRLSELLEFT:
 	case CTRLLEFT:
@@ -1109,7 +1824,7 @@ promptkey(struct Prompt *prompt, char *buf, int len, int operation)
 		drawinput(prompt, 1);
 		return;
 	}
-	if ((ISEDITING(operation) || ISUNDO(operation)) && TAILQ_EMPTY(&prompt->results)) {
+	if (ISEDITING(operation) || ISUNDO(operation)) {
 		getmatchlist(prompt);
 		drawprompt(prompt);
 		return;
@@ -1,9 +1,21 @@
+#include <sys/stat.h>
+#include <sys/wait.h>
+
 #include <err.h>
+#include <errno.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
 #include <limits.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <X11/Xproto.h>
@@ -13,7 +25,12 @@
 
 #define DEFOPENER    "xdg_open" /* default opener */
 #define DEFCALC      "bc"       /* default calculator */
-#define SHELL "sh"
+#define DEFSENTINEL  "\"\n" CALCMARKER "\n\""  /* bc(1) string printing the marker */
+#define LAUNCHSLOW   50         /* milliseconds a launch may take without a warning */
+#define DAMAGEMAX    32         /* damaged rectangles kept per pixmap before merging them */
+#define ICONSPARE    64         /* icons no item uses that are kept for later */
+#define ICONRESCAN   1000       /* milliseconds between checks for changes in the icon paths */
+#define ATLASCOLUMNS 16         /* icons in each row of the icon atlas */
 
 static XRectangle *mons = NULL;                 /* monitors */
 static XrmDatabase xdb = NULL;
@@ -26,14 +43,149 @@ static int savedargc;
 static char **savedargv;
 static int (*xerrorxlib)(Display *, XErrorEvent *);
 
+/* file descriptors watched while waiting for X events */
+static struct Watch {
+	int fd;
+	void (*fn)(int, int, void *);
+	void *arg;
+	struct timespec deadline;       /* when the watch expires, or zero for never */
+} *watches = NULL;
+static struct pollfd *pollfds = NULL;
+static size_t nwatches = 0;
+static size_t watchsize = 0;
+static size_t pollsize = 0;
+
+/* functions called once after some time while waiting for X events */
+static struct Timer {
+	void (*fn)(void *);
+	void *arg;
+	struct timespec deadline;
+} *timers = NULL;
+static size_t ntimers = 0;
+static size_t timersize = 0;
+
+/* children not yet reaped */
+static struct Child {
+	pid_t pid;
+	int role;
+	int fd[3];                      /* our ends of its standard input, output and error, or -1 */
+	struct timespec start;          /* when it was started */
+	char *name;
+	int held;                       /* whether it is not reaped until killchild() */
+} *children = NULL;
+static size_t nchildren = 0;
+static size_t childsize = 0;
+
+/* how many children of each role have been reaped, and how long they ran */
+static struct {
+	const char *name;
+	unsigned long count;
+	unsigned long failed;
+	long totalms;
+	long maxms;
+} childstats[CHILD_LAST] = {
+	[CHILD_LAUNCHED]        = { .name = "launched" },
+	[CHILD_GENERATOR]       = { .name = "generator" },
+	[CHILD_CALCULATOR]      = { .name = "calculator" },
+};
+static int sigchildfd[2] = { -1, -1 };  /* self-pipe written on SIGCHLD and SIGUSR1 */
+static volatile sig_atomic_t dumpchildren = 0;
+
+/* regions of pixmaps drawn on but not yet copied to their windows */
+static struct Damage {
+	Drawable pix;
+	XRectangle rect;
+} *damages = NULL;
+static size_t ndamages = 0;
+static size_t damagesize = 0;
+static XRectangle *cliprects = NULL;
+static size_t clipsize = 0;
+
+/* advances of the glyphs of the current font, in pages of 256 codepoints; -1 if not known yet */
+static int *advances[(0x10FFFF >> 8) + 1];
+static unsigned long advancefont = 0;   /* font the advances are of */
+
+/* icons read from files, shared by the items showing them */
+static struct Icon {
+	char *path;                     /* file the icon was read from, or its name if not found */
+	int cell;                       /* cell of the atlas holding it, or 0 if it could not be read */
+	size_t refs;                    /* how many items hold the icon */
+	int loading;                    /* whether the file is being decoded */
+} *icons = NULL;
+static size_t nicons = 0;
+static size_t iconcachesize = 0;
+static size_t iconsunused = 0;          /* icons in the atlas that no item holds */
+
+/*
+ * The icons are kept with their alpha in the cells of a single ARGB
+ * pixmap, numbered from 1, and composited from there with XRender.
+ */
+static struct {
+	Pixmap pix;
+	Picture pict;
+	GC gc;
+	int ncells;                     /* cells the pixmap has room for */
+	int next;                       /* first cell never used */
+	int *free;                      /* cells freed */
+	int nfree;
+	size_t *icon;                   /* index in icons of the icon in each cell */
+} atlas = {
+	.pix = None,
+	.pict = None,
+	.gc = NULL,
+	.next = 1,
+};
+
+/* icon files decoded by a thread, so drawing a menu never waits for them */
+struct IconJob {
+	struct IconJob *next;
+	char *path;
+	XpmImage image;
+	int status;
+};
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct IconJob *todo;           /* files to decode, guarded by lock */
+	struct IconJob *done;           /* files decoded, guarded by lock */
+	int fd[2];                      /* pipe written by the thread when a file is decoded */
+	int started;
+	void (*fn)(void *);             /* called when icons become ready */
+	void *arg;
+} decoder = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.fd = { -1, -1 },
+};
+
+/* files in the icon paths, by name, in an open-addressing hash table */
+static struct IconFile {
+	char *name;                     /* NULL for empty slots */
+	char *path;
+} *iconfiles = NULL;
+static size_t niconfiles = 0;
+static size_t iconfilesize = 0;         /* number of slots; a power of two */
+static time_t icondirtime[MAXPATHS];    /* when each icon path was modified when it was scanned */
+static struct timespec iconcheck;       /* when the icon paths were last checked */
+static int iconindexed = 0;
+
+/* programs found in $PATH */
+static struct Path {
+	char *name;
+	char *path;
+} *paths = NULL;
+static size_t npaths = 0;
+static size_t pathsize = 0;
+
+extern char **environ;
+
 Atom atoms[ATOM_LAST];
 struct DC dc;
 Display *dpy;
 XIM xim;
 Window root;
-XSyncCounter servertime;
-int sync_event;
-char *opener, *calculator;
+char *opener, *calculator, *calcsentinel;
 
 static int
 xerror(Display *dpy, XErrorEvent *e)
@@ -51,14 +203,93 @@ ealloccolor(const char *s, XftColor *color)
 		errx(1, "could not allocate color: %s", s);
 }
 
-void
-drawtext(Drawable pix, XftColor *color, int x, int y, const char *text, int len)
+static int
+contains(XRectangle *a, XRectangle *b)
 {
-	XftDraw *draw;
+	return b->x >= a->x && b->y >= a->y &&
+	       b->x + b->width <= a->x + a->width &&
+	       b->y + b->height <= a->y + a->height;
+}
+
+/* merge all damaged rectangles of pix into a single one */
+static void
+mergedamage(Drawable pix)
+{
+	XRectangle *rect;
+	size_t i;
+	int x0, y0, x1, y1;
+
+	rect = NULL;
+	x0 = y0 = INT_MAX;
+	x1 = y1 = INT_MIN;
+	for (i = 0; i < ndamages; i++) {
+		if (damages[i].pix != pix)
+			continue;
+		x0 = min(x0, damages[i].rect.x);
+		y0 = min(y0, damages[i].rect.y);
+		x1 = max(x1, damages[i].rect.x + damages[i].rect.width);
+		y1 = max(y1, damages[i].rect.y + damages[i].rect.height);
+		if (rect == NULL) {
+			rect = &damages[i].rect;
+		} else {
+			damages[i--] = damages[--ndamages];
+		}
+	}
+	if (rect != NULL) {
+		*rect = (XRectangle){ .x = x0, .y = y0, .width = x1 - x0, .height = y1 - y0 };
+	}
+}
+
+/* mark a region of pix as drawn on, to be copied by presentdrawing() */
+static void
+damage(Drawable pix, int x, int y, int w, int h)
+{
+	XRectangle rect;
+	size_t i, n;
+
+	if (w <= 0 || h <= 0)
+		return;
+	rect = (XRectangle){ .x = x, .y = y, .width = w, .height = h };
+	n = 0;
+	for (i = 0; i < ndamages; i++) {
+		if (damages[i].pix != pix)
+			continue;
+		if (contains(&damages[i].rect, &rect))
+			return;
+		if (contains(&rect, &damages[i].rect)) {
+			damages[i--] = damages[--ndamages];
+			continue;
+		}
+		n++;
+	}
+	if (ndamages == damagesize) {
+		damagesize = (damagesize == 0) ? 16 : damagesize * 2;
+		damages = erealloc(damages, damagesize * sizeof(*damages));
+	}
+	damages[ndamages++] = (struct Damage){ .pix = pix, .rect = rect };
+	if (n + 1 >= DAMAGEMAX) {
+		mergedamage(pix);
+	}
+}
+
+/* forget the damaged regions of pix */
+static void
+undamage(Drawable pix)
+{
+	size_t i;
 
-	draw = XftDrawCreate(dpy, pix, visual, colormap);
+	for (i = 0; i < ndamages; i++) {
+		if (damages[i].pix == pix) {
+			damages[i--] = damages[--ndamages];
+		}
+	}
+}
+
+void
+drawtext(XftDraw *draw, XftColor *color, int x, int y, const char *text, int len)
+{
 	XftDrawStringUtf8(draw, color, dc.face, x, y, text, len);
-	XftDrawDestroy(draw);
+	damage(XftDrawDrawable(draw), x, y - dc.face->ascent, textadvance(text, len), dc.face->height);
 }
 
 int
@@ -70,6 +301,100 @@ textwidth(const char *text, int len)
 	return box.width;
 }
 
+/* get how much the pen moves after drawing the glyph of codepoint ucs */
+static int
+glyphadvance(FcChar32 ucs)
+{
+	XGlyphInfo box;
+	size_t i;
+	int *page;
+
+	if (advancefont != dc.fontid) {
+		for (i = 0; i < LEN(advances); i++) {
+			free(advances[i]);
+			advances[i] = NULL;
+		}
+		advancefont = dc.fontid;
+	}
+	if (ucs > 0x10FFFF)
+		return 0;
+	if ((page = advances[ucs >> 8]) == NULL) {
+		page = advances[ucs >> 8] = emalloc(256 * sizeof(*page));
+		for (i = 0; i < 256; i++) {
+			page[i] = -1;
+		}
+	}
+	if (page[ucs & 0xFF] == -1) {
+		XftTextExtents32(dpy, dc.face, &ucs, 1, &box);
+		page[ucs & 0xFF] = box.xOff;
+	}
+	return page[ucs & 0xFF];
+}
+
+/*
+ * Set x[i] to the width of the first i bytes of text, for i from beg
+ * (which must be at a character boundary and whose x[beg] must already
+ * be set) to len.  Bytes in the middle of a character get the width up
+ * to the start of that character.
+ */
+void
+textadvances(const char *text, size_t beg, size_t len, int *x)
+{
+	FcChar32 ucs;
+	size_t i;
+	int j, n;
+
+	for (i = beg; i < len; i += n) {
+		if ((n = FcUtf8ToUcs4((FcChar8 *)text + i, &ucs, len - i)) <= 0) {
+			/* invalid byte; it has no glyph */
+			x[i + 1] = x[i];
+			n = 1;
+			continue;
+		}
+		for (j = 1; j < n; j++)
+			x[i + j] = x[i];
+		x[i + n] = x[i] + glyphadvance(ucs);
+	}
+}
+
+/* get the width of the first len bytes of text, like textwidth() but without asking the X server */
+int
+textadvance(const char *text, size_t len)
+{
+	FcChar32 ucs;
+	size_t i;
+	int n, w;
+
+	w = 0;
+	for (i = 0; i < len; i += n) {
+		if ((n = FcUtf8ToUcs4((FcChar8 *)text + i, &ucs, len - i)) <= 0) {
+			n = 1;
+			continue;
+		}
+		w += glyphadvance(ucs);
+	}
+	return w;
+}
+
+/* compute the widths of the texts of item, unless they were computed with the current font */
+void
+measureitem(struct Item *item)
+{
+	if (item->measured == dc.fontid)
+		return;
+	item->measured = dc.fontid;
+	item->namew = item->accw = item->altx = item->altw = 0;
+	if (item->name == NULL)
+		return;
+	item->namew = textwidth(item->name, item->len);
+	if (item->acc != NULL)
+		item->accw = textwidth(item->acc, strlen(item->acc));
+	if (item->altlen > 0 && item->altpos + item->altlen <= item->len) {
+		item->altx = textwidth(item->name, item->altpos);
+		item->altw = textwidth(item->name + item->altpos, item->altlen);
+	}
+}
+
 static void
 initatoms(void)
 {
@@ -176,48 +501,561 @@ epipe(int fd[])
 	}
 }
 
+/* set deadline to msec milliseconds from now, or to zero (never) if msec is 0 */
 void
-eexecshell(const char *cmd, const char *arg)
+setdeadline(struct timespec *deadline, int msec)
 {
-	if (execlp(SHELL, SHELL, "-c", cmd, SHELL, arg, NULL) == -1) {
-		err(1, "%s", "execlp");
+	if (msec <= 0) {
+		*deadline = (struct timespec){ .tv_sec = 0, .tv_nsec = 0 };
+		return;
+	}
+	if (clock_gettime(CLOCK_MONOTONIC, deadline) == -1)
+		err(1, "clock_gettime");
+	deadline->tv_sec += msec / 1000;
+	deadline->tv_nsec += (long)(msec % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+/* get the milliseconds left until deadline, or -1 if it is never */
+int
+timeleft(const struct timespec *deadline)
+{
+	struct timespec now;
+	long long msec;
+
+	if (deadline->tv_sec == 0 && deadline->tv_nsec == 0)
+		return -1;
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+		err(1, "clock_gettime");
+	msec = (long long)(deadline->tv_sec - now.tv_sec) * 1000;
+	msec += (deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+	if (msec < 0)
+		return 0;
+	return (msec > INT_MAX) ? INT_MAX : msec;
+}
+
+/*
+ * Call fn(fd, 0, arg) whenever fd is ready for reading (or hung up).
+ * If timeout is not 0, fn(fd, 1, arg) is called once timeout
+ * milliseconds have passed and whenever fd is ready thereafter, until
+ * the watch is deleted.
+ */
+void
+addwatch(int fd, int timeout, void (*fn)(int, int, void *), void *arg)
+{
+	if (nwatches == watchsize) {
+		watchsize = (watchsize == 0) ? 8 : watchsize * 2;
+		watches = erealloc(watches, watchsize * sizeof(*watches));
 	}
+	watches[nwatches] = (struct Watch){
+		.fd = fd,
+		.fn = fn,
+		.arg = arg,
+	};
+	setdeadline(&watches[nwatches].deadline, timeout);
+	nwatches++;
 }
 
+/* stop watching fd */
 void
-eexeccmd(const char *cmd, const char *arg)
+delwatch(int fd)
 {
-	if (execlp(cmd, cmd, arg, NULL) == -1) {
-		err(1, "%s", "execlp");
+	size_t i;
+
+	for (i = 0; i < nwatches; i++) {
+		if (watches[i].fd == fd) {
+			watches[i] = watches[--nwatches];
+			return;
+		}
 	}
 }
 
+/* call fn(arg) once, msec milliseconds from now; replaces any such call pending */
 void
-edup2(int fd1, int fd2)
+settimer(int msec, void (*fn)(void *), void *arg)
 {
-	if (dup2(fd1, fd2) == -1)
-		err(1, "dup2");
-	close(fd1);
+	deltimer(fn, arg);
+	if (ntimers == timersize) {
+		timersize = (timersize == 0) ? 4 : timersize * 2;
+		timers = erealloc(timers, timersize * sizeof(*timers));
+	}
+	timers[ntimers] = (struct Timer){
+		.fn = fn,
+		.arg = arg,
+	};
+	setdeadline(&timers[ntimers].deadline, max(msec, 1));
+	ntimers++;
 }
 
-pid_t
-efork(void)
+/* cancel the pending call of fn(arg) */
+void
+deltimer(void (*fn)(void *), void *arg)
 {
+	size_t i;
+
+	for (i = 0; i < ntimers; i++) {
+		if (timers[i].fn == fn && timers[i].arg == arg) {
+			timers[i] = timers[--ntimers];
+			return;
+		}
+	}
+}
+
+/* call the timers that are due */
+static void
+runtimers(void)
+{
+	struct Timer timer;
+	size_t i;
+
+	/* a timer can set or delete timers; so rescan after each call */
+	i = 0;
+	while (i < ntimers) {
+		if (timeleft(&timers[i].deadline) != 0) {
+			i++;
+			continue;
+		}
+		timer = timers[i];
+		timers[i] = timers[--ntimers];
+		(*timer.fn)(timer.arg);
+		i = 0;
+	}
+}
+
+/*
+ * Wait for the next X event, serving the watched file descriptors and
+ * the timers meanwhile.  Everything is multiplexed in a single poll(2)
+ * on the X connection and the watched descriptors, with the nearest
+ * deadline as timeout; the queue of X events is drained before waiting.
+ */
+int
+nextevent(XEvent *ev)
+{
+	size_t i, j, n;
+	int timeout, left, expired;
+
+	/* do not let a stream of X events hold the timers back */
+	runtimers();
+	while (!XPending(dpy)) {
+		n = nwatches;
+		if (pollsize < n + 1) {
+			pollsize = watchsize + 1;
+			pollfds = erealloc(pollfds, pollsize * sizeof(*pollfds));
+		}
+		pollfds[0] = (struct pollfd){ .fd = ConnectionNumber(dpy), .events = POLLIN };
+		timeout = -1;
+		for (i = 0; i < n; i++) {
+			pollfds[i + 1] = (struct pollfd){ .fd = watches[i].fd, .events = POLLIN };
+			if ((left = timeleft(&watches[i].deadline)) != -1 && (timeout == -1 || left < timeout)) {
+				timeout = left;
+			}
+		}
+		for (i = 0; i < ntimers; i++)
+			if ((left = timeleft(&timers[i].deadline)) != -1 && (timeout == -1 || left < timeout))
+				timeout = left;
+		if (poll(pollfds, n + 1, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+
+		/* a watch can add or delete watches; so look each one up again */
+		for (i = 1; i <= n; i++) {
+			for (j = 0; j < nwatches; j++)
+				if (watches[j].fd == pollfds[i].fd)
+					break;
+			if (j == nwatches)
+				continue;
+			expired = (timeleft(&watches[j].deadline) == 0);
+			if (pollfds[i].revents != 0 || expired) {
+				(*watches[j].fn)(watches[j].fd, expired, watches[j].arg);
+			}
+		}
+		runtimers();
+	}
+	return XNextEvent(dpy, ev);
+}
+
+/* get the milliseconds passed since then */
+static long
+elapsed(const struct timespec *then)
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+		err(1, "clock_gettime");
+	return (now.tv_sec - then->tv_sec) * 1000 + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+static void
+sigchild(int sig)
+{
+	int saveerrno;
+
+	if (sig == SIGUSR1)
+		dumpchildren = 1;
+	saveerrno = errno;
+	(void)write(sigchildfd[1], "", 1);
+	errno = saveerrno;
+}
+
+/* write the children still running and the statistics of those reaped */
+static void
+printchildren(void)
+{
+	size_t i;
+	int role;
+
+	for (i = 0; i < nchildren; i++) {
+		fprintf(
+			stderr,
+			"%s: %s %ld: %s, running for %ld ms, fds %d %d %d\n",
+			NAME,
+			childstats[children[i].role].name,
+			(long)children[i].pid,
+			children[i].name,
+			elapsed(&children[i].start),
+			children[i].fd[0],
+			children[i].fd[1],
+			children[i].fd[2]
+		);
+	}
+	for (role = 0; role < CHILD_LAST; role++) {
+		if (childstats[role].count == 0)
+			continue;
+		fprintf(
+			stderr,
+			"%s: %s: %lu reaped, %lu failed, %ld ms on average, %ld ms at most\n",
+			NAME,
+			childstats[role].name,
+			childstats[role].count,
+			childstats[role].failed,
+			childstats[role].totalms / (long)childstats[role].count,
+			childstats[role].maxms
+		);
+	}
+}
+
+/* reap the children that have exited; report the launched commands that failed */
+static void
+reapchildren(int fd, int expired, void *arg)
+{
+	struct Child *child;
+	size_t i;
 	pid_t pid;
+	long ms;
+	int status, failed;
+	char buf[64];
+
+	(void)expired;
+	(void)arg;
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	for (i = 0; i < nchildren; ) {
+		child = &children[i];
+		if (child->held) {
+			i++;
+			continue;
+		}
+		if ((pid = waitpid(child->pid, &status, WNOHANG)) == 0 || (pid == -1 && errno == EINTR)) {
+			i++;
+			continue;
+		}
+		ms = elapsed(&child->start);
+		failed = (pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0);
+		if (child->role == CHILD_LAUNCHED && pid != -1 && WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+			warnx("%s: exited with status %d after %ld ms", child->name, WEXITSTATUS(status), ms);
+		} else if (child->role == CHILD_LAUNCHED && pid != -1 && WIFSIGNALED(status)) {
+			warnx("%s: killed by signal %d after %ld ms", child->name, WTERMSIG(status), ms);
+		}
+		childstats[child->role].count++;
+		childstats[child->role].failed += failed;
+		childstats[child->role].totalms += ms;
+		childstats[child->role].maxms = max(childstats[child->role].maxms, ms);
+		free(child->name);
+		children[i] = children[--nchildren];
+	}
+	if (dumpchildren) {
+		dumpchildren = 0;
+		printchildren();
+	}
+}
+
+/*
+ * Reap the children from the event loop, as SIGCHLD is caught; no
+ * code waits for a child.  SIGUSR1 writes the children and their
+ * statistics to stderr.
+ */
+void
+initchildren(void)
+{
+	struct sigaction sa;
+
+	epipe(sigchildfd);
+	(void)fcntl(sigchildfd[0], F_SETFD, FD_CLOEXEC);
+	(void)fcntl(sigchildfd[1], F_SETFD, FD_CLOEXEC);
+	(void)fcntl(sigchildfd[0], F_SETFL, O_NONBLOCK);
+	(void)fcntl(sigchildfd[1], F_SETFL, O_NONBLOCK);
+	sa.sa_handler = sigchild;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGCHLD, &sa, NULL) == -1)
+		err(1, "sigaction");
+	if (sigaction(SIGUSR1, &sa, NULL) == -1)
+		err(1, "sigaction");
+	addwatch(sigchildfd[0], 0, reapchildren, NULL);
+}
+
+/*
+ * Split cmd into words, if it is a plain command whose words are
+ * separated by blanks and have no character special to the shell.
+ * Return NULL if cmd must be run by the shell.  The words and the
+ * array are allocated together, and are freed with a single free(3).
+ */
+char **
+splitcmd(const char *cmd)
+{
+	size_t len, nwords, i;
+	const char *s;
+	char **argv, *p;
+
+	nwords = 0;
+	for (s = cmd; *s != '\0'; s++) {
+		if (isblank((unsigned char)*s))
+			continue;
+		if (!isalnum((unsigned char)*s) && strchr("-_./,:+@", *s) == NULL)
+			return NULL;
+		if (s == cmd || isblank((unsigned char)s[-1])) {
+			nwords++;
+		}
+	}
+	if (nwords == 0)
+		return NULL;
+	len = strlen(cmd);
+	argv = emalloc((nwords + 1) * sizeof(*argv) + len + 1);
+	p = memcpy((char *)(argv + nwords + 1), cmd, len + 1);
+	for (i = 0; i < nwords; i++) {
+		while (isblank((unsigned char)*p))
+			p++;
+		argv[i] = p;
+		p += strcspn(p, " \t");
+		*p++ = '\0';
+	}
+	argv[nwords] = NULL;
+	return argv;
+}
+
+/* find the program name in $PATH; the paths found are kept */
+static const char *
+lookpath(const char *name)
+{
+	size_t i, len;
+	const char *dir, *end;
+	char path[PATH_MAX];
+
+	if (strchr(name, '/') != NULL)
+		return name;
+	for (i = 0; i < npaths; i++)
+		if (strcmp(paths[i].name, name) == 0)
+			return paths[i].path;
+	if ((dir = getenv("PATH")) == NULL)
+		return NULL;
+	for (; *dir != '\0'; dir = (*end == ':') ? end + 1 : end) {
+		end = dir + strcspn(dir, ":");
+		len = end - dir;
+		if (len == 0 || snprintf(path, sizeof(path), "%.*s/%s", (int)len, dir, name) >= (int)sizeof(path))
+			continue;
+		if (access(path, X_OK) == 0) {
+			if (npaths == pathsize) {
+				pathsize = (pathsize == 0) ? 16 : pathsize * 2;
+				paths = erealloc(paths, pathsize * sizeof(*paths));
+			}
+			paths[npaths++] = (struct Path){
+				.name = estrdup(name),
+				.path = estrdup(path),
+			};
+			return paths[npaths - 1].path;
+		}
+	}
+	return NULL;
+}
 
-	if ((pid = fork()) == -1)
-		err(1, "fork");
+/* forget the path found for a program name */
+static void
+forgetpath(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < npaths; i++) {
+		if (strcmp(paths[i].name, name) == 0) {
+			free(paths[i].name);
+			free(paths[i].path);
+			paths[i] = paths[--npaths];
+			return;
+		}
+	}
+}
+
+/*
+ * Start argv without waiting for it and without copying our address
+ * space (as fork(2) would).  The descriptors in fd (unless -1) become
+ * its standard input, output and error, and envp (unless NULL) its
+ * environment.  A launched command runs in a session of its own;
+ * other children run in a process group of their own, which
+ * killchild() kills; they are not reaped before, so that the group
+ * cannot be reused while it may still be signalled.  Return the pid of the child, or -1 and set errno
+ * (to ENOENT if the program is not found in $PATH).
+ */
+pid_t
+startchild(int role, char *const argv[], char *const envp[], const int fd[3])
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	struct timespec start;
+	sigset_t mask, defaults;
+	const char *path;
+	pid_t pid;
+	long ms;
+	short flags;
+	int error, i;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+		err(1, "clock_gettime");
+	if ((path = lookpath(argv[0])) == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	if ((errno = posix_spawnattr_init(&attr)) != 0)
+		err(1, "posix_spawnattr_init");
+	if ((errno = posix_spawn_file_actions_init(&actions)) != 0)
+		err(1, "posix_spawn_file_actions_init");
+	for (i = 0; i < 3; i++) {
+		if (fd[i] == -1)
+			continue;
+		(void)fcntl(fd[i], F_SETFD, FD_CLOEXEC);
+		(void)posix_spawn_file_actions_adddup2(&actions, fd[i], i);
+	}
+	flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP;
+#ifdef POSIX_SPAWN_SETSID
+	if (role == CHILD_LAUNCHED) {
+		flags &= ~POSIX_SPAWN_SETPGROUP;
+		flags |= POSIX_SPAWN_SETSID;
+	}
+#endif
+	(void)posix_spawnattr_setpgroup(&attr, 0);
+	(void)posix_spawnattr_setflags(&attr, flags);
+	sigemptyset(&mask);
+	(void)posix_spawnattr_setsigmask(&attr, &mask);
+	/* SIGPIPE is ignored by us, not by what we run */
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGPIPE);
+	(void)posix_spawnattr_setsigdefault(&attr, &defaults);
+	if (envp == NULL)
+		envp = environ;
+	error = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+	if (error == ENOENT && path != argv[0]) {
+		/* the program has moved since it was looked up */
+		forgetpath(argv[0]);
+		error = posix_spawnp(&pid, argv[0], &actions, &attr, argv, envp);
+	}
+	(void)posix_spawn_file_actions_destroy(&actions);
+	(void)posix_spawnattr_destroy(&attr);
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	if (role == CHILD_LAUNCHED && (ms = elapsed(&start)) >= LAUNCHSLOW)
+		warnx("%s: took %ld ms to launch", argv[0], ms);
+	if (nchildren == childsize) {
+		childsize = (childsize == 0) ? 8 : childsize * 2;
+		children = erealloc(children, childsize * sizeof(*children));
+	}
+	children[nchildren++] = (struct Child){
+		.pid = pid,
+		.role = role,
+		.fd = { -1, -1, -1 },
+		.start = start,
+		.name = estrdup(argv[0]),
+		.held = (role != CHILD_LAUNCHED),
+	};
 	return pid;
 }
 
+/*
+ * Kill a child and the processes it has started, and let it be reaped.
+ * As a child started by startchild() (other than a launched command)
+ * is not reaped before, its process group is still its own.
+ */
 void
-esetsid(void)
+killchild(pid_t pid)
 {
-	if (setsid() == -1) {
-		err(1, "setsid");
+	size_t i;
+
+	for (i = 0; i < nchildren; i++) {
+		if (children[i].pid == pid && children[i].held) {
+			(void)kill(-pid, SIGKILL);
+			children[i].held = 0;
+
+			/* it may have exited already, and SIGCHLD been caught */
+			(void)write(sigchildfd[1], "", 1);
+			return;
+		}
 	}
 }
 
+/* record our ends of the pipes to the standard input, output and error of a child */
+void
+setchildfds(pid_t pid, int in, int out, int err)
+{
+	size_t i;
+
+	for (i = 0; i < nchildren; i++) {
+		if (children[i].pid == pid) {
+			children[i].fd[0] = in;
+			children[i].fd[1] = out;
+			children[i].fd[2] = err;
+			return;
+		}
+	}
+}
+
+/* run argv in a session of its own; return -1 if the program is not found */
+int
+launch(char *const argv[])
+{
+	static const int fd[3] = { -1, -1, -1 };
+
+	if (startchild(CHILD_LAUNCHED, argv, NULL, fd) != -1)
+		return 0;
+	if (errno == ENOENT)
+		return -1;
+	warn("%s", argv[0]);
+	return 0;
+}
+
+/* run cmd in the shell, with arg as its $1 */
+void
+launchshell(const char *cmd, const char *arg)
+{
+	char *argv[] = { SHELL, "-c", (char *)cmd, SHELL, (char *)arg, NULL };
+
+	if (launch(argv) == -1)
+		warnx("%s: not found", SHELL);
+}
+
+/* run cmd with arg as its argument */
+void
+launchcmd(const char *cmd, const char *arg)
+{
+	char *argv[] = { (char *)cmd, (char *)arg, NULL };
+
+	if (launch(argv) == -1)
+		warnx("%s: not found", cmd);
+}
+
 void
 drawtriangle(Drawable pix, unsigned int color, int x, int y, int direction)
 {
@@ -242,6 +1080,13 @@ drawtriangle(Drawable pix, unsigned int color, int x, int y, int direction)
 		triangle[2] = (XPoint){x, y + dc.triangle_height};
 	}
 	triangle[3] = triangle[0];
+	damage(
+		pix,
+		min(triangle[0].x, min(triangle[1].x, triangle[2].x)),
+		min(triangle[0].y, min(triangle[1].y, triangle[2].y)),
+		max(triangle[0].x, max(triangle[1].x, triangle[2].x)) - min(triangle[0].x, min(triangle[1].x, triangle[2].x)) + 1,
+		max(triangle[0].y, max(triangle[1].y, triangle[2].y)) - min(triangle[0].y, min(triangle[1].y, triangle[2].y)) + 1
+	);
 	XSetForeground(dpy, dc.gc, color);
 	XFillPolygon(
 		dpy,
@@ -284,6 +1129,7 @@ drawrectangle(Pixmap pix, XRectangle rect, unsigned int color)
 		return;
 	XSetForeground(dpy, dc.gc, color);
 	XFillRectangle(dpy, pix, dc.gc, rect.x, rect.y, rect.width, rect.height);
+	damage(pix, rect.x, rect.y, rect.width, rect.height);
 }
 
 void
@@ -316,6 +1162,12 @@ drawshadows(Pixmap pix, XRectangle rect, unsigned long top, unsigned long bot)
 	XChangeGC(dpy, dc.gc, GCForeground, &val);
 	XFillRectangles(dpy, pix, dc.gc, recs, config.shadowThickness * 2);
 
+	/* the shadows are four strips along the edges */
+	damage(pix, rect.x, rect.y, rect.width, config.shadowThickness);
+	damage(pix, rect.x, rect.y, config.shadowThickness, rect.height);
+	damage(pix, rect.x + rect.width - config.shadowThickness, rect.y, config.shadowThickness, rect.height);
+	damage(pix, rect.x, rect.y + rect.height - config.shadowThickness, rect.width, config.shadowThickness);
+
 	free(recs);
 }
 
@@ -338,18 +1190,58 @@ drawseparator(Drawable pix, int x, int y, int w, int dash)
 	val.foreground = dc.topShadow.pixel;
 	XChangeGC(dpy, dc.gc, GCForeground | GCLineStyle, &val);
 	XDrawLine(dpy, pix, dc.gc, x, y, x + w, y);
+	damage(pix, x - 1, y - 1, w + 2, 2);
 }
 
 void
 copypixmap(Pixmap to, Pixmap from, XRectangle rect)
 {
 	XCopyArea(dpy, from, to, dc.gc, 0, 0, rect.width, rect.height, rect.x, rect.y);
+	damage(to, rect.x, rect.y, rect.width, rect.height);
 }
 
+/* copy all of pix to win (when win is exposed or mapped) */
 void
 commitdrawing(Window win, Pixmap pix, XRectangle rect)
 {
 	XCopyArea(dpy, pix, win, dc.gc, 0, 0, rect.width, rect.height, 0, 0);
+	undamage(pix);
+}
+
+/* copy to win only the regions of pix drawn on since they were last copied */
+void
+presentdrawing(Window win, Pixmap pix)
+{
+	size_t i, n;
+	int x0, y0, x1, y1;
+
+	n = 0;
+	x0 = y0 = INT_MAX;
+	x1 = y1 = INT_MIN;
+	for (i = 0; i < ndamages; i++) {
+		if (damages[i].pix != pix)
+			continue;
+		if (n == clipsize) {
+			clipsize = (clipsize == 0) ? DAMAGEMAX : clipsize * 2;
+			cliprects = erealloc(cliprects, clipsize * sizeof(*cliprects));
+		}
+		cliprects[n++] = damages[i].rect;
+		x0 = min(x0, damages[i].rect.x);
+		y0 = min(y0, damages[i].rect.y);
+		x1 = max(x1, damages[i].rect.x + damages[i].rect.width);
+		y1 = max(y1, damages[i].rect.y + damages[i].rect.height);
+	}
+	if (n == 0)
+		return;
+	undamage(pix);
+
+	/* a single copy of the bounding box, clipped to the damaged rectangles */
+	if (n > 1)
+		XSetClipRectangles(dpy, dc.gc, 0, 0, cliprects, n, Unsorted);
+	XCopyArea(dpy, pix, win, dc.gc, x0, y0, x1 - x0, y1 - y0, x0, y0);
+	if (n > 1) {
+		XSetClipMask(dpy, dc.gc, None);
+	}
 }
 
 XRectangle
@@ -368,6 +1260,12 @@ getselmon(XRectangle *rect)
 	return mons[selmon];
 }
 
+void
+settitle(Window win, const char *title)
+{
+	XmbSetWMProperties(dpy, win, title, title, NULL, 0, NULL, NULL, NULL);
+}
+
 Window
 createwindow(XRectangle *rect, int type, const char *title)
 {
@@ -436,6 +1334,7 @@ unmapwin(Window win)
 void
 freepixmap(Pixmap pix)
 {
+	undamage(pix);
 	XFreePixmap(dpy, pix);
 }
 
@@ -449,54 +1348,477 @@ createpixmap(XRectangle rect, Window win)
 	return pix;
 }
 
+/* create the Xft drawable to draw text on pix; rebind it with changedraw() when pix is recreated */
+XftDraw *
+createdraw(Pixmap pix)
+{
+	XftDraw *draw;
+
+	if ((draw = XftDrawCreate(dpy, pix, visual, colormap)) == NULL)
+		errx(1, "could not create Xft drawable");
+	return draw;
+}
+
+void
+changedraw(XftDraw *draw, Pixmap pix)
+{
+	XftDrawChange(draw, pix);
+}
+
+void
+freedraw(XftDraw *draw)
+{
+	XftDrawDestroy(draw);
+}
+
 static int
 isabsolute(const char *s)
 {
 	return s[0] == '/' || (s[0] == '.' && (s[1] == '/' || (s[1] == '.' && s[2] == '/')));
 }
 
-void
-geticon(Window win, char *file, Pixmap *icon, Pixmap *mask)
+static size_t
+hashname(const char *s)
+{
+	uint64_t hash;
+
+	hash = 0xCBF29CE484222325ULL;           /* FNV-1a */
+	while (*s != '\0') {
+		hash ^= (unsigned char)*s++;
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+/* get the slot of name in the table of icon files; it is empty if name is not there */
+static struct IconFile *
+iconslot(const char *name)
 {
-	XpmAttributes attr;
-	int status, i;
+	size_t i;
+
+	i = hashname(name) & (iconfilesize - 1);
+	while (iconfiles[i].name != NULL && strcmp(iconfiles[i].name, name) != 0)
+		i = (i + 1) & (iconfilesize - 1);
+	return &iconfiles[i];
+}
+
+static void
+addiconfile(const char *name, const char *path)
+{
+	struct IconFile *old, *slot;
+	size_t i, oldsize;
+
+	if (2 * (niconfiles + 1) > iconfilesize) {
+		old = iconfiles;
+		oldsize = iconfilesize;
+		iconfilesize *= 2;
+		iconfiles = ecalloc(iconfilesize, sizeof(*iconfiles));
+		for (i = 0; i < oldsize; i++)
+			if (old[i].name != NULL)
+				*iconslot(old[i].name) = old[i];
+		free(old);
+	}
+	slot = iconslot(name);
+	if (slot->name != NULL)         /* the file in an earlier path wins */
+		return;
+	slot->name = estrdup(name);
+	slot->path = estrdup(path);
+	niconfiles++;
+}
+
+/* forget the icon at index i of the cache, freeing its cell */
+static void
+removeicon(size_t i)
+{
+	if (icons[i].cell != 0) {
+		if (icons[i].refs == 0)
+			iconsunused--;
+		atlas.free[atlas.nfree++] = icons[i].cell;
+	}
+	free(icons[i].path);
+	icons[i] = icons[--nicons];
+	if (i < nicons && icons[i].cell != 0) {
+		atlas.icon[icons[i].cell] = i;
+	}
+}
+
+/* list the files in the icon paths */
+static void
+indexicons(void)
+{
+	struct dirent *dp;
+	struct stat sb;
+	DIR *dirp;
+	size_t i;
 	char path[PATH_MAX];
 
-	*icon = None;
-	*mask = None;
-	memset(&attr, 0, sizeof(attr));
-	status = XpmFileInvalid;
-	if (config.niconpaths == 0 || isabsolute(file)) {
-		status = XpmReadFileToPixmap(dpy, win, file, icon, mask, &attr);
-	} else {
-		for (i = 0; status != XpmSuccess && i < config.niconpaths; i++) {
-			snprintf(path, sizeof(path), "%s/%s", config.iconpaths[i], file);
-			status = XpmReadFileToPixmap(dpy, win, path, icon, mask, &attr);
+	for (i = 0; i < iconfilesize; i++) {
+		free(iconfiles[i].name);
+		free(iconfiles[i].path);
+		iconfiles[i] = (struct IconFile){ .name = NULL, .path = NULL };
+	}
+	niconfiles = 0;
+	if (iconfilesize == 0) {
+		iconfilesize = 256;
+		iconfiles = ecalloc(iconfilesize, sizeof(*iconfiles));
+	}
+	for (i = 0; i < (size_t)config.niconpaths; i++) {
+		icondirtime[i] = (stat(config.iconpaths[i], &sb) == 0) ? sb.st_mtime : 0;
+		if ((dirp = opendir(config.iconpaths[i])) == NULL)
+			continue;
+		while ((dp = readdir(dirp)) != NULL) {
+			if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+				continue;
+			if (snprintf(path, sizeof(path), "%s/%s", config.iconpaths[i], dp->d_name) >= (int)sizeof(path))
+				continue;
+
+			/* what could not be read must not hide a file in a later path */
+			if (stat(path, &sb) == -1 || !S_ISREG(sb.st_mode) || access(path, R_OK) == -1)
+				continue;
+			addiconfile(dp->d_name, path);
+		}
+		closedir(dirp);
+	}
+
+	/* files may have appeared; try again the icons that were not found */
+	for (i = 0; i < nicons; i++) {
+		if (icons[i].cell == 0 && !icons[i].loading) {
+			removeicon(i--);
+		}
+	}
+	iconindexed = 1;
+}
+
+/* list the files in the icon paths again if any of them changed */
+static void
+checkiconpaths(void)
+{
+	struct stat sb;
+	int i;
+
+	if (iconindexed && elapsed(&iconcheck) < ICONRESCAN)
+		return;
+	if (clock_gettime(CLOCK_MONOTONIC, &iconcheck) == -1)
+		err(1, "clock_gettime");
+	for (i = 0; iconindexed && i < config.niconpaths; i++) {
+		if (icondirtime[i] != ((stat(config.iconpaths[i], &sb) == 0) ? sb.st_mtime : 0)) {
+			break;
+		}
+	}
+	if (!iconindexed || i < config.niconpaths) {
+		indexicons();
+	}
+}
+
+/* find the file of an icon in the icon paths */
+static const char *
+findicon(const char *file, char *path, size_t size)
+{
+	struct IconFile *slot;
+	int i;
+
+	if (config.niconpaths == 0 || isabsolute(file))
+		return file;
+	if (strchr(file, '/') == NULL) {
+		checkiconpaths();
+		slot = iconslot(file);
+		return slot->path;
+	}
+
+	/* a file in a subdirectory of an icon path is not indexed */
+	for (i = 0; i < config.niconpaths; i++) {
+		if (snprintf(path, size, "%s/%s", config.iconpaths[i], file) >= (int)size)
+			continue;
+		if (access(path, R_OK) == 0) {
+			return path;
+		}
+	}
+	return NULL;
+}
+
+/* decode the icon files asked for, one at a time */
+static void *
+decodeicons(void *p)
+{
+	struct IconJob *job;
+
+	(void)p;
+	for (;;) {
+		pthread_mutex_lock(&decoder.lock);
+		while (decoder.todo == NULL)
+			pthread_cond_wait(&decoder.cond, &decoder.lock);
+		job = decoder.todo;
+		decoder.todo = job->next;
+		pthread_mutex_unlock(&decoder.lock);
+
+		memset(&job->image, 0, sizeof(job->image));
+		job->status = XpmReadFileToXpmImage(job->path, &job->image, NULL);
+
+		pthread_mutex_lock(&decoder.lock);
+		job->next = decoder.done;
+		decoder.done = job;
+		pthread_mutex_unlock(&decoder.lock);
+		(void)write(decoder.fd[1], "", 1);
+	}
+	return NULL;
+}
+
+/* get the position of a cell in the atlas */
+static void
+cellorigin(int cell, int *x, int *y)
+{
+	*x = ((cell - 1) % ATLASCOLUMNS) * config.iconsize;
+	*y = ((cell - 1) / ATLASCOLUMNS) * config.iconsize;
+}
+
+/* get an unused cell of the atlas, making the atlas larger if it is full */
+static int
+alloccell(void)
+{
+	Pixmap pix;
+	int rows;
+
+	if (atlas.nfree > 0)
+		return atlas.free[--atlas.nfree];
+	if (atlas.next > atlas.ncells) {
+		rows = (atlas.ncells == 0) ? 4 : 2 * atlas.ncells / ATLASCOLUMNS;
+		pix = XCreatePixmap(dpy, root, ATLASCOLUMNS * config.iconsize, rows * config.iconsize, 32);
+		if (pix == None)
+			errx(1, "could not create pixmap");
+		if (atlas.gc == NULL)
+			atlas.gc = XCreateGC(dpy, pix, 0, NULL);
+		if (atlas.pix != None) {
+			XCopyArea(
+				dpy, atlas.pix, pix, atlas.gc, 0, 0,
+				ATLASCOLUMNS * config.iconsize,
+				atlas.ncells / ATLASCOLUMNS * config.iconsize,
+				0, 0
+			);
+			XRenderFreePicture(dpy, atlas.pict);
+			XFreePixmap(dpy, atlas.pix);
+		}
+		atlas.pix = pix;
+		atlas.pict = XRenderCreatePicture(dpy, pix, XRenderFindStandardFormat(dpy, PictStandardARGB32), 0, NULL);
+		atlas.ncells = rows * ATLASCOLUMNS;
+		atlas.free = erealloc(atlas.free, atlas.ncells * sizeof(*atlas.free));
+		atlas.icon = erealloc(atlas.icon, (atlas.ncells + 1) * sizeof(*atlas.icon));
+	}
+	return atlas.next++;
+}
+
+/* convert a decoded icon to ARGB and put it in a cell of the atlas */
+static int
+uploadicon(XpmImage *image)
+{
+	static const uint32_t one = 1;
+	XColor color;
+	XImage *ximage;
+	uint32_t *colors, *argb;
+	unsigned int i, x, y, n, k;
+	const char *name;
+	int cell, cellx, celly;
+
+	colors = ecalloc(image->ncolors, sizeof(*colors));
+	for (i = 0; i < image->ncolors; i++) {
+		if ((name = image->colorTable[i].c_color) == NULL &&
+		    (name = image->colorTable[i].g_color) == NULL &&
+		    (name = image->colorTable[i].g4_color) == NULL)
+			name = image->colorTable[i].m_color;
+		if (name == NULL || strcasecmp(name, "None") == 0 || !XParseColor(dpy, colormap, name, &color))
+			continue;       /* transparent */
+		colors[i] = 0xFF000000 | (color.red >> 8) << 16 | (color.green >> 8) << 8 | color.blue >> 8;
+	}
+
+	/* like before, the icon is cut to iconsize; what it does not cover is transparent */
+	n = config.iconsize;
+	argb = ecalloc(n * n, sizeof(*argb));
+	for (y = 0; y < n && y < image->height; y++) {
+		for (x = 0; x < n && x < image->width; x++) {
+			if ((k = image->data[y * image->width + x]) < image->ncolors) {
+				argb[y * n + x] = colors[k];
+			}
 		}
 	}
-	if (status != XpmSuccess)
-		goto error;
-	return;
-error:
-	if (*icon != None)
-		XFreePixmap(dpy, *icon);
-	if (*mask != None)
-		XFreePixmap(dpy, *mask);
-	warnx("could not open pixmap: %s", file);
+	free(colors);
+	if ((ximage = XCreateImage(dpy, visual, 32, ZPixmap, 0, (char *)argb, n, n, 32, 0)) == NULL)
+		errx(1, "could not create image");
+	ximage->byte_order = (*(const unsigned char *)&one == 1) ? LSBFirst : MSBFirst;
+	cell = alloccell();
+	cellorigin(cell, &cellx, &celly);
+	XPutImage(dpy, atlas.pix, atlas.gc, ximage, 0, 0, cellx, celly, n, n);
+	XDestroyImage(ximage);
+	return cell;
 }
 
+/* put the icons decoded by the thread in the atlas */
+static void
+icondecoded(int fd, int expired, void *p)
+{
+	struct IconJob *job, *next;
+	size_t i;
+	char buf[BUFSIZ];
+
+	(void)expired;
+	(void)p;
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&decoder.lock);
+	job = decoder.done;
+	decoder.done = NULL;
+	pthread_mutex_unlock(&decoder.lock);
+	for (; job != NULL; job = next) {
+		next = job->next;
+		for (i = 0; i < nicons; i++)
+			if (icons[i].loading && strcmp(icons[i].path, job->path) == 0)
+				break;
+		if (i < nicons) {
+			icons[i].loading = 0;
+			if (job->status == XpmSuccess) {
+				icons[i].cell = uploadicon(&job->image);
+				atlas.icon[icons[i].cell] = i;
+				iconsunused++;
+			} else {
+				warnx("could not open pixmap: %s", job->path);
+			}
+		}
+		if (job->status == XpmSuccess)
+			XpmFreeXpmImage(&job->image);
+		free(job->path);
+		free(job);
+	}
+	if (decoder.fn != NULL) {
+		(*decoder.fn)(decoder.arg);
+	}
+}
+
+/* ask the thread to decode an icon file */
+static void
+decodeicon(const char *path)
+{
+	struct IconJob *job;
+	sigset_t set, oset;
+	int error;
+
+	if (!decoder.started) {
+		epipe(decoder.fd);
+		if (fcntl(decoder.fd[0], F_SETFL, O_NONBLOCK) == -1 ||
+		    fcntl(decoder.fd[0], F_SETFD, FD_CLOEXEC) == -1 ||
+		    fcntl(decoder.fd[1], F_SETFD, FD_CLOEXEC) == -1)
+			err(1, "fcntl");
+		addwatch(decoder.fd[0], 0, icondecoded, NULL);
+
+		/* signals are for the main thread */
+		sigfillset(&set);
+		pthread_sigmask(SIG_SETMASK, &set, &oset);
+		error = pthread_create(&decoder.thread, NULL, decodeicons, NULL);
+		pthread_sigmask(SIG_SETMASK, &oset, NULL);
+		if (error != 0) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+		decoder.started = 1;
+	}
+	job = emalloc(sizeof(*job));
+	job->path = estrdup(path);
+	pthread_mutex_lock(&decoder.lock);
+	job->next = decoder.todo;
+	decoder.todo = job;
+	pthread_cond_signal(&decoder.cond);
+	pthread_mutex_unlock(&decoder.lock);
+}
+
+/* set the function called whenever icons asked for with geticon() become ready */
 void
-drawicon(Pixmap pix, Pixmap icon, Pixmap mask, int x, int y)
+initicons(void (*fn)(void *), void *arg)
 {
-	XGCValues val;
+	decoder.fn = fn;
+	decoder.arg = arg;
+}
 
-	val.clip_x_origin = x;
-	val.clip_y_origin = y;
-	val.clip_mask = mask;
-	XChangeGC(dpy, dc.gc, GCClipXOrigin | GCClipYOrigin | GCClipMask, &val);
-	XCopyArea(dpy, icon, pix, dc.gc, 0, 0, config.iconsize, config.iconsize, x, y);
-	val.clip_mask = None;
-	XChangeGC(dpy, dc.gc, GCClipMask, &val);
+/*
+ * Get an icon, sharing the one already read from the same file; release
+ * it with puticon().  Return -1 if the file is still being decoded, and
+ * 0 otherwise (with *icon set to 0 if the file could not be read).
+ */
+int
+geticon(const char *file, int *icon)
+{
+	struct Icon *p;
+	size_t i;
+	const char *path;
+	char buf[PATH_MAX];
+
+	*icon = 0;
+	if ((path = findicon(file, buf, sizeof(buf))) == NULL)
+		path = file;
+	for (i = 0; i < nicons; i++)
+		if (strcmp(icons[i].path, path) == 0)
+			break;
+	if (i == nicons) {
+		if (nicons == iconcachesize) {
+			iconcachesize = (iconcachesize == 0) ? 16 : iconcachesize * 2;
+			icons = erealloc(icons, iconcachesize * sizeof(*icons));
+		}
+		icons[nicons++] = (struct Icon){
+			.path = estrdup(path),
+			.cell = 0,
+			.refs = 0,
+			.loading = 0,
+		};
+
+		/* a file that cannot be read is remembered, and not tried again */
+		if (path == file && config.niconpaths > 0 && !isabsolute(file)) {
+			warnx("could not find pixmap: %s", file);
+		} else {
+			icons[i].loading = 1;
+			decodeicon(path);
+		}
+	}
+	p = &icons[i];
+	if (p->loading)
+		return -1;
+	if (p->cell == 0)
+		return 0;
+	if (p->refs++ == 0)
+		iconsunused--;
+	*icon = p->cell;
+	return 0;
+}
+
+/*
+ * Release an icon got with geticon().  Once twice ICONSPARE icons are
+ * unused, they are freed down to ICONSPARE; the icons that could not
+ * be read are kept, so their files are not tried again.
+ */
+void
+puticon(int icon)
+{
+	size_t i;
+
+	if (--icons[atlas.icon[icon]].refs == 0)
+		iconsunused++;
+	if (iconsunused <= 2 * ICONSPARE)
+		return;
+	for (i = 0; i < nicons && iconsunused > ICONSPARE; i++) {
+		if (icons[i].cell != 0 && icons[i].refs == 0) {
+			removeicon(i--);
+		}
+	}
+}
+
+/* composite an icon from the atlas over the drawable of draw */
+void
+drawicon(XftDraw *draw, int icon, int x, int y)
+{
+	int cellx, celly;
+
+	cellorigin(icon, &cellx, &celly);
+	XRenderComposite(
+		dpy, PictOpOver, atlas.pict, None, XftDrawPicture(draw),
+		cellx, celly, 0, 0, x, y,
+		config.iconsize, config.iconsize
+	);
+	damage(XftDrawDrawable(draw), x, y, config.iconsize, config.iconsize);
 }
 
 char *
@@ -648,23 +1970,22 @@ querypointer(int *x, int *y)
 void
 xinit(int argc, char *argv[])
 {
-	int ncounter, i, tmp;
-	char *xrm;
-	XSyncSystemCounter *counters;
+	char *xrm, *s;
 
 	if ((opener = getenv("OPENER")) == NULL || *opener == '\0')
 		opener = DEFOPENER;
 	if ((calculator = getenv("CALC")) == NULL || *calculator == '\0')
 		calculator = DEFCALC;
+	if ((calcsentinel = getenv("CALCSENTINEL")) == NULL || *calcsentinel == '\0') {
+		/* without a sentinel, another calculator answers with a line */
+		s = strrchr(calculator, '/');
+		calcsentinel = (strcmp((s != NULL) ? s + 1 : calculator, "bc") == 0) ? DEFSENTINEL : NULL;
+	}
 	XInitThreads();
 	if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
 		warnx("warning: no locale support");
 	if ((dpy = XOpenDisplay(NULL)) == NULL)
 		errx(1, "could not open display");
-	if (!XSyncQueryExtension(dpy, &sync_event, &tmp))
-		errx(1, "XSync extension not available");
-	if (!XSyncInitialize(dpy, &tmp, &tmp))
-		errx(1, "failed to initialize XSync extension");
 	if ((xim = XOpenIM(dpy, NULL, NULL, NULL)) == NULL)
 		errx(1, "XOpenIM: could not open input device");
 	if ((xrm = XResourceManagerString(dpy)) != NULL)
@@ -679,19 +2000,6 @@ xinit(int argc, char *argv[])
 	initatoms();
 	savedargc = argc;
 	savedargv = argv;
-	servertime = None;
-	if ((counters = XSyncListSystemCounters(dpy, &ncounter)) != NULL) {
-		for (i = 0; i < ncounter; i++) {
-			if (strcmp(counters[i].name, "SERVERTIME") == 0) {
-				servertime = counters[i].counter;
-				break;
-			}
-		}
-		XSyncFreeSystemCounterList(counters);
-	}
-	if (servertime == None) {
-		errx(1, "SERVERTIME counter not found");
-	}
 }
 
 void
@@ -719,6 +2027,7 @@ initdc(void)
 			errx(1, "could not open font: %s", config.faceName);
 		}
 	}
+	dc.fontid++;
 	dc.fontascent = dc.face->ascent;
 	dc.triangle_height = 2 * max(4, dc.face->height / 4);
 	dc.triangle_width = dc.triangle_height / 2;